@@ -15,10 +15,20 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_SRC_FILES := \
 	src/lua/main.cpp \
+	src/common/AsyncRequest.cpp \
+	src/common/ConnectionPool.cpp \
+	src/common/ContentDecoder.cpp \
+	src/common/FileReader.cpp \
+	src/common/FileWriter.cpp \
+	src/common/HeaderMap.cpp \
 	src/common/HTTPS.cpp \
 	src/common/HTTPRequest.cpp \
+	src/common/HTTPResponseParser.cpp \
 	src/common/HTTPSClient.cpp \
 	src/common/PlaintextConnection.cpp \
+	src/common/Resolver.cpp \
+	src/common/Stats.cpp \
+	src/common/WorkerPool.cpp \
 	src/android/AndroidClient.cpp \
 	src/generic/UnixLibraryLoader.cpp
 
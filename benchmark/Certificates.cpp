@@ -0,0 +1,125 @@
+#include "Certificates.h"
+
+#include <memory>
+#include <stdexcept>
+
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+namespace
+{
+	template<typename T, void (*Free)(T *)>
+	struct Deleter
+	{
+		void operator()(T *ptr) const { Free(ptr); }
+	};
+
+	typedef std::unique_ptr<EVP_PKEY, Deleter<EVP_PKEY, EVP_PKEY_free>> Key;
+	typedef std::unique_ptr<EVP_PKEY_CTX, Deleter<EVP_PKEY_CTX, EVP_PKEY_CTX_free>> KeyContext;
+	typedef std::unique_ptr<X509, Deleter<X509, X509_free>> Certificate;
+	typedef std::unique_ptr<BIO, Deleter<BIO, BIO_free_all>> Bio;
+
+	void check(bool ok, const char *what)
+	{
+		if (!ok)
+			throw std::runtime_error(std::string("Could not ") + what);
+	}
+
+	Key createKey()
+	{
+		KeyContext context(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr));
+		EVP_PKEY *key = nullptr;
+
+		check(context
+			&& EVP_PKEY_keygen_init(context.get()) > 0
+			&& EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context.get(), NID_X9_62_prime256v1) > 0
+			&& EVP_PKEY_keygen(context.get(), &key) > 0, "generate a key");
+
+		return Key(key);
+	}
+
+	void addExtension(X509 *cert, X509 *issuer, int nid, const char *value)
+	{
+		X509V3_CTX context;
+		X509V3_set_ctx_nodb(&context);
+		X509V3_set_ctx(&context, issuer, cert, nullptr, nullptr, 0);
+
+		X509_EXTENSION *extension = X509V3_EXT_conf_nid(nullptr, &context, nid, value);
+		bool added = extension && X509_add_ext(cert, extension, -1);
+		X509_EXTENSION_free(extension);
+		check(added, "add a certificate extension");
+	}
+
+	// Self-signed when there is no issuer
+	Certificate createCertificate(const char *commonName, EVP_PKEY *key, X509 *issuer, EVP_PKEY *issuerKey, long serial)
+	{
+		Certificate cert(X509_new());
+		check(cert != nullptr, "create a certificate");
+
+		X509_set_version(cert.get(), 2);
+		ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), serial);
+		X509_gmtime_adj(X509_getm_notBefore(cert.get()), -60 * 60);
+		X509_gmtime_adj(X509_getm_notAfter(cert.get()), 24 * 60 * 60);
+		X509_set_pubkey(cert.get(), key);
+
+		X509_NAME *name = X509_get_subject_name(cert.get());
+		X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) commonName, -1, -1, 0);
+
+		X509 *signer = issuer ? issuer : cert.get();
+		X509_set_issuer_name(cert.get(), X509_get_subject_name(signer));
+
+		if (!issuer)
+		{
+			addExtension(cert.get(), signer, NID_basic_constraints, "critical,CA:TRUE");
+			addExtension(cert.get(), signer, NID_key_usage, "critical,keyCertSign,cRLSign");
+			addExtension(cert.get(), signer, NID_subject_key_identifier, "hash");
+		}
+		else
+		{
+			addExtension(cert.get(), signer, NID_basic_constraints, "CA:FALSE");
+			addExtension(cert.get(), signer, NID_ext_key_usage, "serverAuth");
+			addExtension(cert.get(), signer, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+		}
+
+		check(X509_sign(cert.get(), issuerKey, EVP_sha256()) > 0, "sign a certificate");
+		return cert;
+	}
+
+	std::string toString(BIO *bio)
+	{
+		char *data = nullptr;
+		long size = BIO_get_mem_data(bio, &data);
+		return std::string(data, (size_t) size);
+	}
+
+	std::string toPem(X509 *cert)
+	{
+		Bio bio(BIO_new(BIO_s_mem()));
+		check(bio && PEM_write_bio_X509(bio.get(), cert), "write a certificate");
+		return toString(bio.get());
+	}
+
+	std::string toPem(EVP_PKEY *key)
+	{
+		Bio bio(BIO_new(BIO_s_mem()));
+		check(bio && PEM_write_bio_PrivateKey(bio.get(), key, nullptr, nullptr, 0, nullptr, nullptr), "write a key");
+		return toString(bio.get());
+	}
+}
+
+TestCertificates createTestCertificates()
+{
+	Key caKey = createKey();
+	Certificate ca = createCertificate("lua-https benchmark CA", caKey.get(), nullptr, caKey.get(), 1);
+
+	Key serverKey = createKey();
+	Certificate server = createCertificate("localhost", serverKey.get(), ca.get(), caKey.get(), 2);
+
+	TestCertificates certs;
+	certs.caPem = toPem(ca.get());
+	certs.serverCertPem = toPem(server.get());
+	certs.serverKeyPem = toPem(serverKey.get());
+	return certs;
+}
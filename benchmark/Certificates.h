@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+// A throwaway CA and a certificate it signed for localhost and 127.0.0.1,
+// made fresh on every run so there is nothing to keep around or expire
+struct TestCertificates
+{
+	std::string caPem;
+	std::string serverCertPem;
+	std::string serverKeyPem;
+};
+
+// Throws if OpenSSL can't make them
+TestCertificates createTestCertificates();
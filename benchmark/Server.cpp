@@ -0,0 +1,322 @@
+#include "Server.h"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#	include <sys/prctl.h>
+#endif
+
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+
+namespace
+{
+	// Request heads larger than this close the connection
+	const size_t maxHeadSize = 65536;
+
+	int listenOnLoopback(uint16_t &port)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1)
+			throw std::runtime_error("Could not create a socket");
+
+		int reuse = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+
+		socklen_t size = sizeof(addr);
+		if (bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0 || getsockname(fd, (sockaddr *) &addr, &size) != 0)
+		{
+			close(fd);
+			throw std::runtime_error("Could not listen on 127.0.0.1");
+		}
+
+		port = ntohs(addr.sin_port);
+		return fd;
+	}
+
+	SSL_CTX *createContext(const TestCertificates &certs)
+	{
+		SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+		if (!context)
+			return nullptr;
+
+		BIO *certBio = BIO_new_mem_buf(certs.serverCertPem.data(), (int) certs.serverCertPem.size());
+		BIO *keyBio = BIO_new_mem_buf(certs.serverKeyPem.data(), (int) certs.serverKeyPem.size());
+		X509 *cert = PEM_read_bio_X509(certBio, nullptr, nullptr, nullptr);
+		EVP_PKEY *key = PEM_read_bio_PrivateKey(keyBio, nullptr, nullptr, nullptr);
+
+		bool ok = cert && key && SSL_CTX_use_certificate(context, cert) == 1 && SSL_CTX_use_PrivateKey(context, key) == 1;
+
+		X509_free(cert);
+		EVP_PKEY_free(key);
+		BIO_free(certBio);
+		BIO_free(keyBio);
+
+		if (!ok)
+		{
+			SSL_CTX_free(context);
+			return nullptr;
+		}
+
+		return context;
+	}
+
+	// One client connection, plain or over TLS
+	class Stream
+	{
+	public:
+		Stream(int fd, SSL_CTX *context)
+			: fd(fd)
+			, ssl(context ? SSL_new(context) : nullptr)
+		{
+			int noDelay = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+			if (ssl)
+				SSL_set_fd(ssl, fd);
+		}
+
+		~Stream()
+		{
+			if (ssl)
+			{
+				SSL_shutdown(ssl);
+				SSL_free(ssl);
+			}
+			close(fd);
+		}
+
+		bool handshake()
+		{
+			return !ssl || SSL_accept(ssl) == 1;
+		}
+
+		long read(char *buffer, size_t size)
+		{
+			if (ssl)
+				return SSL_read(ssl, buffer, (int) std::min<size_t>(size, INT_MAX));
+			return recv(fd, buffer, size, 0);
+		}
+
+		bool write(const char *data, size_t size)
+		{
+			while (size > 0)
+			{
+				long written;
+				if (ssl)
+					written = SSL_write(ssl, data, (int) std::min<size_t>(size, 1 << 30));
+				else
+					written = send(fd, data, size, 0);
+
+				if (written <= 0)
+					return false;
+
+				data += written;
+				size -= (size_t) written;
+			}
+
+			return true;
+		}
+
+	private:
+		int fd;
+		SSL *ssl;
+	};
+
+	std::string toLower(std::string str)
+	{
+		for (char &c : str)
+			c = (char) std::tolower((unsigned char) c);
+		return str;
+	}
+
+	// The value of a header in a lowercased request head, or empty
+	std::string headerValue(const std::string &head, const char *name)
+	{
+		std::string key = std::string("\r\n") + name + ":";
+		size_t start = head.find(key);
+		if (start == std::string::npos)
+			return std::string();
+
+		start += key.size();
+		size_t end = head.find("\r\n", start);
+		size_t first = head.find_first_not_of(" \t", start);
+		return first < end ? head.substr(first, end - first) : std::string();
+	}
+
+	void respond(Stream &stream, int status, const char *reason, const char *contentType, const char *body, size_t size, bool sendBody)
+	{
+		std::string head = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n"
+			+ "Content-Type: " + contentType + "\r\n"
+			+ "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+
+		if (stream.write(head.data(), head.size()) && sendBody)
+			stream.write(body, size);
+	}
+
+	void serve(int fd, SSL_CTX *context, const std::string &payload)
+	{
+		Stream stream(fd, context);
+		if (!stream.handshake())
+			return;
+
+		std::string input;
+		char buffer[16384];
+
+		while (true)
+		{
+			size_t headEnd;
+			while ((headEnd = input.find("\r\n\r\n")) == std::string::npos)
+			{
+				if (input.size() > maxHeadSize)
+					return;
+
+				long read = stream.read(buffer, sizeof(buffer));
+				if (read <= 0)
+					return;
+				input.append(buffer, (size_t) read);
+			}
+
+			std::string head = toLower(input.substr(0, headEnd + 2));
+			input.erase(0, headEnd + 4);
+
+			// Request bodies are only read past
+			unsigned long long remaining = strtoull(headerValue(head, "content-length").c_str(), nullptr, 10);
+			while (remaining > 0)
+			{
+				if (input.empty())
+				{
+					long read = stream.read(buffer, sizeof(buffer));
+					if (read <= 0)
+						return;
+					input.append(buffer, (size_t) read);
+				}
+
+				size_t used = (size_t) std::min<unsigned long long>(remaining, input.size());
+				input.erase(0, used);
+				remaining -= used;
+			}
+
+			size_t methodEnd = head.find(' ');
+			size_t pathEnd = head.find(' ', methodEnd + 1);
+			if (methodEnd == std::string::npos || pathEnd == std::string::npos)
+				return;
+
+			std::string method = head.substr(0, methodEnd);
+			std::string path = head.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+			bool sendBody = method != "head";
+
+			if (path == "/json")
+				respond(stream, 200, "OK", "application/json", Server::json().data(), Server::json().size(), sendBody);
+			else if (path.compare(0, 7, "/bytes/") == 0 && strtoull(path.c_str() + 7, nullptr, 10) <= payload.size())
+				respond(stream, 200, "OK", "application/octet-stream", payload.data(), (size_t) strtoull(path.c_str() + 7, nullptr, 10), sendBody);
+			else
+				respond(stream, 404, "Not Found", "text/plain", "", 0, sendBody);
+
+			if (headerValue(head, "connection") == "close")
+				return;
+		}
+	}
+
+	void run(int httpFd, int httpsFd, const TestCertificates &certs, size_t maxPayload)
+	{
+		signal(SIGPIPE, SIG_IGN);
+#ifdef __linux__
+		// Goes away with the benchmark, even if that crashed
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+		SSL_CTX *context = createContext(certs);
+		if (!context)
+			_exit(1);
+
+		std::string payload(maxPayload, '\0');
+		for (size_t i = 0; i < payload.size(); ++i)
+			payload[i] = "0123456789abcdef"[i % 16];
+
+		pollfd listeners[] = {
+			{httpFd, POLLIN, 0},
+			{httpsFd, POLLIN, 0},
+		};
+
+		while (true)
+		{
+			if (poll(listeners, 2, -1) < 0)
+				continue;
+
+			for (const pollfd &listener : listeners)
+			{
+				if (!(listener.revents & POLLIN))
+					continue;
+
+				int fd = accept(listener.fd, nullptr, nullptr);
+				if (fd == -1)
+					continue;
+
+				SSL_CTX *tls = listener.fd == httpsFd ? context : nullptr;
+				std::thread([fd, tls, &payload]() { serve(fd, tls, payload); }).detach();
+			}
+		}
+	}
+}
+
+Server::Server(const TestCertificates &certs, size_t maxPayload)
+	: pid(-1)
+{
+	int httpFd = listenOnLoopback(httpPort);
+	int httpsFd;
+
+	try
+	{
+		httpsFd = listenOnLoopback(httpsPort);
+	}
+	catch (...)
+	{
+		close(httpFd);
+		throw;
+	}
+
+	pid = fork();
+	if (pid == 0)
+	{
+		run(httpFd, httpsFd, certs, maxPayload);
+		_exit(0);
+	}
+
+	close(httpFd);
+	close(httpsFd);
+
+	if (pid == -1)
+		throw std::runtime_error("Could not start the server process");
+}
+
+Server::~Server()
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, nullptr, 0);
+}
+
+const std::string &Server::json()
+{
+	static const std::string document = "{\"id\":42,\"name\":\"lua-https\",\"tags\":[\"http\",\"tls\"],\"ok\":true}";
+	return document;
+}
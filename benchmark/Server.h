@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <sys/types.h>
+
+#include "Certificates.h"
+
+// A minimal HTTP/1.1 server on 127.0.0.1, plain and over TLS, for the
+// benchmark. It runs in a process of its own, so it doesn't add to the
+// memory measured for the client or compete with it for locks.
+//   /json       a small JSON document, json()
+//   /bytes/N    N bytes, up to the maximum payload given
+// Connections are kept alive, request bodies are read and thrown away.
+class Server
+{
+public:
+	// Throws if the ports can't be opened
+	Server(const TestCertificates &certs, size_t maxPayload);
+	// Stops the server process
+	~Server();
+
+	uint16_t getHttpPort() const { return httpPort; }
+	uint16_t getHttpsPort() const { return httpsPort; }
+
+	static const std::string &json();
+
+private:
+	Server(const Server &) = delete;
+	Server &operator=(const Server &) = delete;
+
+	pid_t pid;
+	uint16_t httpPort;
+	uint16_t httpsPort;
+};
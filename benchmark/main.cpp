@@ -0,0 +1,403 @@
+// Measures the backends against a server on the loopback interface, so the
+// numbers only depend on this machine. Each case runs in a process of its
+// own, which gives it a peak RSS of its own and a cold start.
+//
+// Results go to stdout as JSON lines, one per case, a table goes to stderr.
+// With --baseline, the results are compared against an earlier run and the
+// exit code is 1 if any case got slower than the tolerance allows.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common/config.h"
+#include "common/HTTPS.h"
+#include "common/HTTPSClient.h"
+
+#ifdef HTTPS_BACKEND_CURL
+#	include "generic/CurlClient.h"
+#endif
+#ifdef HTTPS_BACKEND_OPENSSL
+#	include "common/ConnectionClient.h"
+#	include "generic/OpenSSLConnection.h"
+#endif
+
+#include "Certificates.h"
+#include "Server.h"
+
+namespace
+{
+	typedef std::chrono::steady_clock clock;
+
+	struct Backend
+	{
+		const char *name;
+		std::function<HTTPSClient *()> create;
+	};
+
+	const Backend backends[] = {
+#ifdef HTTPS_BACKEND_CURL
+		{"curl", []() -> HTTPSClient * { return new CurlClient(); }},
+#endif
+#ifdef HTTPS_BACKEND_OPENSSL
+		{"openssl", []() -> HTTPSClient * { return new ConnectionClient<OpenSSLConnection>(); }},
+#endif
+	};
+
+	struct Payload
+	{
+		const char *name;
+		size_t size;
+		bool json;
+	};
+
+	const Payload payloads[] = {
+		{"json", 0, true},
+		{"1KiB", 1024, false},
+		{"64KiB", 64 * 1024, false},
+		{"1MiB", 1024 * 1024, false},
+		{"10MiB", 10 * 1024 * 1024, false},
+		{"100MiB", 100 * 1024 * 1024, false},
+	};
+
+	struct Options
+	{
+		double seconds = 2.0;
+		size_t maxSize = 100 * 1024 * 1024;
+		std::string backend;
+		std::string scheme;
+		std::string output;
+		std::string baseline;
+		double tolerance = 0.15;
+	};
+
+	// Enough to say something about p99 even for the slowest cases
+	const size_t minRequests = 5;
+	const size_t maxRequests = 1000000;
+
+	struct Case
+	{
+		const Backend *backend;
+		std::string scheme;
+		uint16_t port;
+		const Payload *payload;
+	};
+
+	std::string describe(const Case &c)
+	{
+		return std::string("\"backend\":\"") + c.backend->name + "\",\"scheme\":\"" + c.scheme + "\",\"payload\":\"" + c.payload->name + "\"";
+	}
+
+	std::string errorLine(const Case &c, const std::string &error)
+	{
+		return "{" + describe(c) + ",\"error\":\"" + error + "\"}";
+	}
+
+	double percentile(const std::vector<double> &sorted, double p)
+	{
+		size_t rank = (size_t) std::ceil(p * sorted.size());
+		return sorted[std::max<size_t>(rank, 1) - 1];
+	}
+
+	uint64_t peakRSS()
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+		return (uint64_t) usage.ru_maxrss;
+#else
+		return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+	}
+
+	// Runs in the child process, returns the JSON line
+	std::string runCase(const Case &c, const std::string &caPem, double seconds)
+	{
+		std::unique_ptr<HTTPSClient> client(c.backend->create());
+		if (!client->valid())
+			return errorLine(c, "backend not available");
+
+		setCABundle(caPem);
+
+		const Payload &payload = *c.payload;
+		size_t expected = payload.json ? Server::json().size() : payload.size;
+		std::string path = payload.json ? "/json" : "/bytes/" + std::to_string(payload.size);
+
+		HTTPSClient::Request req(c.scheme + "://localhost:" + std::to_string(c.port) + path);
+		req.timeout = std::chrono::milliseconds(60000);
+
+		auto succeeded = [expected](const HTTPSClient::Reply &reply) {
+			return reply.responseCode == 200 && reply.error.empty() && reply.body.size() == expected;
+		};
+
+		// The first request connects, that isn't what's measured
+		if (!succeeded(client->request(req)))
+			return errorLine(c, "warm-up request failed");
+
+		std::vector<double> latencies;
+		uint64_t bytes = 0;
+
+		clock::time_point start = clock::now();
+		clock::time_point deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+
+		do
+		{
+			clock::time_point begin = clock::now();
+			HTTPSClient::Reply reply = client->request(req);
+			clock::time_point end = clock::now();
+
+			if (!succeeded(reply))
+				return errorLine(c, "request failed");
+
+			latencies.push_back(std::chrono::duration<double, std::milli>(end - begin).count());
+			bytes += reply.body.size();
+		}
+		while ((clock::now() < deadline || latencies.size() < minRequests) && latencies.size() < maxRequests);
+
+		double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		std::sort(latencies.begin(), latencies.end());
+
+		char line[512];
+		snprintf(line, sizeof(line),
+			"{%s,\"size\":%zu,\"requests\":%zu,\"seconds\":%.3f,\"requests_per_second\":%.1f,"
+			"\"p50_ms\":%.4f,\"p99_ms\":%.4f,\"bytes_per_second\":%.0f,\"peak_rss_bytes\":%llu}",
+			describe(c).c_str(), expected, latencies.size(), elapsed, latencies.size() / elapsed,
+			percentile(latencies, 0.5), percentile(latencies, 0.99), bytes / elapsed, (unsigned long long) peakRSS());
+
+		return line;
+	}
+
+	// Forks, so that nothing measured is left over from an earlier case
+	std::string runIsolated(const Case &c, const std::string &caPem, double seconds)
+	{
+		int fds[2];
+		if (pipe(fds) != 0)
+			return errorLine(c, "could not create a pipe");
+
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			close(fds[0]);
+
+			std::string line;
+			try
+			{
+				line = runCase(c, caPem, seconds);
+			}
+			catch (const std::exception &e)
+			{
+				line = errorLine(c, e.what());
+			}
+
+			ssize_t written = write(fds[1], line.data(), line.size());
+			_exit(written == (ssize_t) line.size() ? 0 : 1);
+		}
+
+		close(fds[1]);
+		if (pid == -1)
+		{
+			close(fds[0]);
+			return errorLine(c, "could not fork");
+		}
+
+		std::string line;
+		char buffer[512];
+		ssize_t read;
+		while ((read = ::read(fds[0], buffer, sizeof(buffer))) > 0)
+			line.append(buffer, (size_t) read);
+		close(fds[0]);
+
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || line.empty())
+			return errorLine(c, "benchmark process crashed");
+
+		return line;
+	}
+
+	// Only reads what this program writes, one flat object per line
+	std::string field(const std::string &line, const char *name)
+	{
+		std::string key = std::string("\"") + name + "\":";
+		size_t start = line.find(key);
+		if (start == std::string::npos)
+			return std::string();
+
+		start += key.size();
+		if (line[start] == '"')
+			return line.substr(start + 1, line.find('"', start + 1) - start - 1);
+
+		return line.substr(start, line.find_first_of(",}", start) - start);
+	}
+
+	std::string caseKey(const std::string &line)
+	{
+		return field(line, "backend") + " " + field(line, "scheme") + " " + field(line, "payload");
+	}
+
+	std::map<std::string, double> readBaseline(const std::string &path)
+	{
+		std::ifstream file(path);
+		if (!file)
+			throw std::runtime_error("Could not read " + path);
+
+		std::map<std::string, double> baseline;
+		for (std::string line; std::getline(file, line); )
+		{
+			std::string rate = field(line, "requests_per_second");
+			if (!rate.empty())
+				baseline[caseKey(line)] = atof(rate.c_str());
+		}
+
+		return baseline;
+	}
+
+	void printRow(const std::string &line)
+	{
+		if (!field(line, "error").empty())
+		{
+			fprintf(stderr, "%-24s error: %s\n", caseKey(line).c_str(), field(line, "error").c_str());
+			return;
+		}
+
+		fprintf(stderr, "%-24s %10.1f req/s  p50 %9.3f ms  p99 %9.3f ms  %9.1f MiB/s  peak RSS %7.1f MiB\n",
+			caseKey(line).c_str(),
+			atof(field(line, "requests_per_second").c_str()),
+			atof(field(line, "p50_ms").c_str()),
+			atof(field(line, "p99_ms").c_str()),
+			atof(field(line, "bytes_per_second").c_str()) / (1024 * 1024),
+			atof(field(line, "peak_rss_bytes").c_str()) / (1024 * 1024));
+	}
+
+	void usage()
+	{
+		fprintf(stderr,
+			"Usage: https-benchmark [options]\n"
+			"  --seconds S       how long each case runs, 2 by default\n"
+			"  --max-size BYTES  skip payloads larger than this\n"
+			"  --backend NAME    only run this backend\n"
+			"  --scheme NAME     only run http or https\n"
+			"  --output FILE     also write the results to FILE\n"
+			"  --baseline FILE   compare against the results of an earlier run\n"
+			"  --tolerance F     how much slower than the baseline is a regression, 0.15 by default\n");
+	}
+
+	bool parseOptions(int argc, char **argv, Options &options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			if (arg == "--help" || i + 1 >= argc)
+				return false;
+
+			const char *value = argv[++i];
+			if (arg == "--seconds")
+				options.seconds = atof(value);
+			else if (arg == "--max-size")
+				options.maxSize = (size_t) strtoull(value, nullptr, 10);
+			else if (arg == "--backend")
+				options.backend = value;
+			else if (arg == "--scheme")
+				options.scheme = value;
+			else if (arg == "--output")
+				options.output = value;
+			else if (arg == "--baseline")
+				options.baseline = value;
+			else if (arg == "--tolerance")
+				options.tolerance = atof(value);
+			else
+				return false;
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options))
+	{
+		usage();
+		return 2;
+	}
+
+	try
+	{
+		std::map<std::string, double> baseline;
+		if (!options.baseline.empty())
+			baseline = readBaseline(options.baseline);
+
+		std::ofstream output;
+		if (!options.output.empty())
+		{
+			output.open(options.output);
+			if (!output)
+				throw std::runtime_error("Could not write " + options.output);
+		}
+
+		TestCertificates certs = createTestCertificates();
+		Server server(certs, options.maxSize);
+
+		bool regressed = false;
+		for (const Backend &backend : backends)
+		{
+			if (!options.backend.empty() && options.backend != backend.name)
+				continue;
+
+			for (const char *scheme : {"http", "https"})
+			{
+				if (!options.scheme.empty() && options.scheme != scheme)
+					continue;
+
+				for (const Payload &payload : payloads)
+				{
+					if (payload.size > options.maxSize)
+						continue;
+
+					uint16_t port = scheme == std::string("https") ? server.getHttpsPort() : server.getHttpPort();
+					std::string line = runIsolated({&backend, scheme, port, &payload}, certs.caPem, options.seconds);
+
+					printf("%s\n", line.c_str());
+					fflush(stdout);
+					if (output)
+						output << line << "\n" << std::flush;
+					printRow(line);
+
+					auto previous = baseline.find(caseKey(line));
+					if (previous == baseline.end())
+						continue;
+
+					double rate = atof(field(line, "requests_per_second").c_str());
+					double change = rate / previous->second - 1.0;
+					if (change < -options.tolerance || !field(line, "error").empty())
+					{
+						fprintf(stderr, "%-24s REGRESSION: %.1f%% compared to %.1f req/s\n", "", change * 100.0, previous->second);
+						regressed = true;
+					}
+				}
+			}
+		}
+
+		return regressed ? 1 : 0;
+	}
+	catch (const std::exception &e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 2;
+	}
+}
@@ -92,10 +92,222 @@ local function test_send(method, kind)
 	end
 end
 
+local function test_async()
+	local handle = assert(https.requestAsync("https://postman-echo.com/get", {method = "GET"}))
+	while not handle:poll() do end
+
+	local code, response, headers = handle:result()
+	checkcode(code, 200)
+	assert(json.decode(response).url, "missing url in response")
+	assert(headers, "expected headers")
+end
+
+local function test_sink()
+	local chunks = {}
+	local headersCode
+	local code, response = https.request("https://postman-echo.com/get", {
+		onheaders = function(code, headers)
+			headersCode = code
+			assert(type(headers) == "table", "expected headers")
+		end,
+		sink = function(data)
+			chunks[#chunks + 1] = data
+		end
+	})
+	checkcode(code, 200)
+	checkcode(headersCode, 200)
+	assert(#response == 0, "expected the body to go to the sink")
+	assert(json.decode(table.concat(chunks)).url, "missing url in response")
+
+	-- Returning false aborts the request
+	code = https.request("https://postman-echo.com/get", {sink = function() return false end})
+	assert(code == nil, "expected the request to be aborted")
+end
+
+local function test_download()
+	local path = os.tmpname()
+	local code, headers = https.download("https://postman-echo.com/get", path)
+	checkcode(code, 200)
+	assert(headers, "expected headers")
+
+	local file = assert(io.open(path, "rb"))
+	local contents = file:read("*a")
+	file:close()
+	assert(json.decode(contents).url, "missing url in downloaded file")
+
+	-- Error pages leave the file alone
+	code = https.download("https://postman-echo.com/status/404", path)
+	checkcode(code, 404)
+
+	file = assert(io.open(path, "rb"))
+	assert(file:read("*a") == contents, "file changed by an error page")
+	file:close()
+	os.remove(path)
+end
+
+local function test_send_function()
+	local pieces, i = {"Foo=Bar", "&Key=Value"}, 0
+	local code, response = https.request("https://postman-echo.com/post", {
+		data = function()
+			i = i + 1
+			return pieces[i]
+		end
+	})
+	checkcode(code, 200)
+	local root = json.decode(response)
+	assert(root.form.Foo == "Bar" and root.form.Key == "Value", "form data mismatch")
+end
+
+local function test_send_file()
+	local path = os.tmpname()
+	local file = assert(io.open(path, "wb"))
+	file:write(json.encode({Foo = "Bar"}))
+	file:close()
+
+	local code, response = https.request("https://postman-echo.com/post", {
+		headers = {["Content-Type"] = "application/json"},
+		datafile = path
+	})
+	os.remove(path)
+	checkcode(code, 200)
+	assert(json.decode(response).json.Foo == "Bar", "file data mismatch")
+end
+
+local function test_dns_cache()
+	https.resolve("postman-echo.com")
+	local code = https.request("https://postman-echo.com/get")
+	checkcode(code, 200)
+
+	-- Without the cache every request looks the host up again
+	https.setDNSCacheTTL(0)
+	code = https.request("https://postman-echo.com/get")
+	checkcode(code, 200)
+	https.setDNSCacheTTL(60, 5)
+end
+
+local function test_timeout()
+	local code, err = https.request("https://postman-echo.com/delay/3", {timeout = 1})
+	assert(code == nil and err == "timeout", "expected a timeout, got "..tostring(code))
+
+	code = https.request("https://postman-echo.com/delay/1", {timeout = 10, connect_timeout = 5, idle_timeout = 5})
+	checkcode(code, 200)
+end
+
+local function test_decompress()
+	local code, body, headers = https.request("https://postman-echo.com/gzip", {decompress = true})
+	checkcode(code, 200)
+	assert(json.decode(body).gzipped, "expected the body to be decoded")
+
+	code, body = https.request("https://postman-echo.com/get", {decompress = true})
+	checkcode(code, 200)
+	assert(json.decode(body).headers["accept-encoding"], "expected Accept-Encoding to be sent")
+end
+
+local function test_request_many()
+	local results = https.requestMany({
+		{"https://postman-echo.com/get"},
+		{"https://postman-echo.com/post", {data = "a=1"}},
+		{"https://postman-echo.com/status/404"},
+	}, {concurrency = 2})
+
+	assert(#results == 3, "expected 3 results, got "..#results)
+	checkcode(results[1].code, 200)
+	assert(json.decode(results[2].body).form.a == "1", "expected the results in order")
+	checkcode(results[3].code, 404)
+end
+
+local function test_async_data()
+	-- The body is borrowed from Lua, it has to survive being collected meanwhile
+	local handle = assert(https.requestAsync("https://postman-echo.com/post", {data = string.rep("x", 100000)..1}))
+	collectgarbage()
+	while not handle:poll() do end
+
+	local code, response = handle:result()
+	checkcode(code, 200)
+	assert(json.decode(response).data == string.rep("x", 100000).."1", "body mismatch")
+
+	-- Numbers are sent as their string form
+	code, response = https.request("https://postman-echo.com/post", {data = 42})
+	checkcode(code, 200)
+	assert(json.decode(response).data == "42", "body mismatch")
+end
+
+local function test_buffer()
+	local code, body = https.request("https://postman-echo.com/get", {buffer = true})
+	checkcode(code, 200)
+	assert(type(body) == "userdata", "expected a buffer")
+
+	local str = body:tostring()
+	assert(#body == #str and body:size() == #str, "size mismatch")
+	assert(body:sub(2, 5) == str:sub(2, 5) and body:sub(-3) == str:sub(-3), "sub mismatch")
+	assert(json.decode(str).url, "missing url in response")
+end
+
+local function test_timings()
+	local code, response, headers, timings = https.request("https://postman-echo.com/get", {timings = true})
+	checkcode(code, 200)
+	assert(type(timings) == "table", "expected timings")
+	assert(timings.total >= timings.first_byte, "total before the first byte")
+	assert(timings.body_size == #response, "body size mismatch")
+	assert(type(timings.reused) == "boolean", "expected reused")
+end
+
+local function test_stats()
+	https.resetStats()
+	local code = https.request("https://postman-echo.com/get")
+	checkcode(code, 200)
+
+	local stats = https.stats()
+	assert(stats.requests["2xx"] == 1, "expected one 2xx request")
+	local host, latency = next(stats.latency)
+	assert(host and latency.count == 1, "expected the request's latency")
+	assert(latency.p50 <= latency.max, "percentiles out of order")
+
+	https.resetStats()
+	assert(https.stats().requests["2xx"] == 0, "reset didn't clear the counters")
+end
+
+local function test_backends()
+	local names, current = https.backends()
+	assert(#names > 0 and current == names[1], "expected the first backend to be selected")
+
+	for _, name in ipairs(names) do
+		local code = https.request("https://postman-echo.com/get", {backend = name})
+		checkcode(code, 200)
+	end
+
+	assert(https.setBackend(names[#names]))
+	assert(select(2, https.backends()) == names[#names], "setBackend didn't stick")
+	assert(https.setBackend(nil))
+
+	assert(not https.setBackend("no such backend"), "expected an error")
+	assert(not https.request("https://postman-echo.com/get", {backend = "no such backend"}), "expected an error")
+end
+
+local function test_init()
+	local backend = assert(https.init())
+	assert(backend == select(2, https.backends()), "init loaded another backend")
+end
+
 -- Tests call
+print("test init") test_init()
 print("test downloading json library") test_download_json()
 print("test custom header") test_custom_header()
 print("test HEAD") test_head()
+print("test asynchronous request") test_async()
+print("test sink and onheaders") test_sink()
+print("test download") test_download()
+print("test data function") test_send_function()
+print("test datafile") test_send_file()
+print("test DNS cache") test_dns_cache()
+print("test timeouts") test_timeout()
+print("test decompress") test_decompress()
+print("test requestMany") test_request_many()
+print("test asynchronous request body") test_async_data()
+print("test buffer") test_buffer()
+print("test timings") test_timings()
+print("test stats") test_stats()
+print("test backends") test_backends()
 
 for _, method in ipairs({"POST", "PUT", "PATCH", "DELETE"}) do
 	for _, kind in ipairs({"form", "json"}) do
@@ -2,6 +2,8 @@
 
 #ifdef HTTPS_BACKEND_ANDROID
 
+#include <algorithm>
+#include <chrono>
 #include <sstream>
 #include <type_traits>
 
@@ -107,6 +109,23 @@ HTTPSClient::Reply AndroidClient::request(const HTTPSClient::Request &req)
 	jmethodID getInterleavedHeaders = env->GetMethodID(httpsClass, "getInterleavedHeaders", "()[Ljava/lang/String;");
 	jmethodID getResponse = env->GetMethodID(httpsClass, "getResponse", "()[B");
 	jmethodID getResponseCode = env->GetMethodID(httpsClass, "getResponseCode", "()I");
+	jmethodID setTimeouts = env->GetMethodID(httpsClass, "setTimeouts", "(II)V");
+	jmethodID isTimedOut = env->GetMethodID(httpsClass, "isTimedOut", "()Z");
+
+	// The Java side takes the body as one array, files and sources are read in first
+	std::string collected;
+	StringRef postdata = req.postdata;
+	if (!req.postfile.empty() || req.source)
+	{
+		if (!readBody(req, collected))
+		{
+			HTTPSClient::Reply reply;
+			reply.responseCode = 0;
+			return reply;
+		}
+
+		postdata = collected;
+	}
 
 	jobject httpsObject = env->NewObject(httpsClass, constructor);
 
@@ -121,30 +140,38 @@ HTTPSClient::Reply AndroidClient::request(const HTTPSClient::Request &req)
 	env->DeleteLocalRef(method);
 
 	// Set post data
-	if (!req.postdata.empty())
+	if (!postdata.empty())
 	{
 		jmethodID setPostData = env->GetMethodID(httpsClass, "setPostData", "([B)V");
-		jbyteArray byteArray = env->NewByteArray((jsize) req.postdata.length());
+		jbyteArray byteArray = env->NewByteArray((jsize) postdata.size);
 		jbyte *byteArrayData = env->GetByteArrayElements(byteArray, nullptr);
 
 		// The usage of memcpy is intentional.
 		// NOLINTNEXTLINE
-		memcpy(byteArrayData, req.postdata.data(), req.postdata.length());
+		memcpy(byteArrayData, postdata.data, postdata.size);
 		env->ReleaseByteArrayElements(byteArray, byteArrayData, 0);
 
 		env->CallVoidMethod(httpsObject, setPostData, byteArray);
 		env->DeleteLocalRef(byteArray);
 	}
 
+	// HttpURLConnection has no limit for the whole request, each wait gets the tighter of the two instead
+	auto tighter = [&req](std::chrono::milliseconds timeout) {
+		if (timeout.count() == 0 || (req.timeout.count() > 0 && req.timeout < timeout))
+			timeout = req.timeout;
+		return (jint) std::min<long long>(timeout.count(), 0x7fffffff);
+	};
+	env->CallVoidMethod(httpsObject, setTimeouts, tighter(req.connectTimeout), tighter(req.idleTimeout));
+
 	// Set headers
 	if (!req.headers.empty())
 	{
 		jmethodID addHeader = env->GetMethodID(httpsClass, "addHeader", "(Ljava/lang/String;Ljava/lang/String;)V");
 
-		for (auto &header : req.headers)
+		for (const auto &header : req.headers)
 		{
-			jstring headerKey = newStringUTF(env, header.first);
-			jstring headerValue = newStringUTF(env, header.second);
+			jstring headerKey = newStringUTF(env, header.name.str());
+			jstring headerValue = newStringUTF(env, header.value.str());
 
 			env->CallVoidMethod(httpsObject, addHeader, headerKey, headerValue);
 			env->DeleteLocalRef(headerKey);
@@ -156,6 +183,12 @@ HTTPSClient::Reply AndroidClient::request(const HTTPSClient::Request &req)
 	HTTPSClient::Reply response;
 	jboolean status = env->CallBooleanMethod(httpsObject, request);
 
+	if (!status && env->CallBooleanMethod(httpsObject, isTimedOut))
+	{
+		env->DeleteLocalRef(httpsObject);
+		throw HTTPSClient::TimeoutError();
+	}
+
 	// Get response
 	response.responseCode = env->CallIntMethod(httpsObject, getResponseCode);
 
@@ -170,7 +203,7 @@ HTTPSClient::Reply AndroidClient::request(const HTTPSClient::Request &req)
 			jstring key = (jstring) env->GetObjectArrayElement(interleavedHeaders, i);
 			jstring value = (jstring) env->GetObjectArrayElement(interleavedHeaders, i + 1);
 
-			response.headers[getStringUTF(env, key)] = getStringUTF(env, value);
+			response.headers.set(getStringUTF(env, key), getStringUTF(env, value));
 
 			env->DeleteLocalRef(key);
 			env->DeleteLocalRef(value);
@@ -190,6 +223,9 @@ HTTPSClient::Reply AndroidClient::request(const HTTPSClient::Request &req)
 
 			env->DeleteLocalRef(responseData);
 		}
+
+		// The Java side only hands us the body once it is complete
+		deliver(req, response);
 	}
 
 	env->DeleteLocalRef(httpsObject);
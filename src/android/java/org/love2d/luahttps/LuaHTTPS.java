@@ -12,6 +12,7 @@ import java.io.OutputStream;
 import java.net.HttpURLConnection;
 import java.net.MalformedURLException;
 import java.net.ProtocolException;
+import java.net.SocketTimeoutException;
 import java.net.URL;
 import java.util.ArrayList;
 import java.util.HashMap;
@@ -27,6 +28,9 @@ class LuaHTTPS {
     private byte[] postData;
     private byte[] response;
     private int responseCode;
+    private int connectTimeout;
+    private int readTimeout;
+    private boolean timedOut;
     private HashMap<String, String> headers;
 
     public LuaHTTPS() {
@@ -40,6 +44,9 @@ class LuaHTTPS {
         postData = null;
         response = null;
         responseCode = 0;
+        connectTimeout = 0;
+        readTimeout = 0;
+        timedOut = false;
         headers.clear();
     }
 
@@ -58,6 +65,17 @@ class LuaHTTPS {
         this.method = method.toUpperCase();
     }
 
+    @Keep
+    public void setTimeouts(int connectTimeout, int readTimeout) {
+        this.connectTimeout = connectTimeout;
+        this.readTimeout = readTimeout;
+    }
+
+    @Keep
+    public boolean isTimedOut() {
+        return timedOut;
+    }
+
     @Keep
     public void addHeader(String key, String value) {
         headers.put(key, value);
@@ -118,6 +136,10 @@ class LuaHTTPS {
             return false;
         }
 
+        // Zero means no limit for both
+        connection.setConnectTimeout(connectTimeout);
+        connection.setReadTimeout(readTimeout);
+
         // Set request method
         try {
             connection.setRequestMethod(method);
@@ -140,6 +162,7 @@ class LuaHTTPS {
                 out.write(postData);
             } catch (Exception e) {
                 Log.e(TAG, "Error", e);
+                timedOut = e instanceof SocketTimeoutException;
                 connection.disconnect();
                 return false;
             }
@@ -176,6 +199,7 @@ class LuaHTTPS {
             }
         } catch (Exception e) {
             Log.e(TAG, "Error", e);
+            timedOut = e instanceof SocketTimeoutException;
             connection.disconnect();
             return false;
         }
@@ -4,6 +4,8 @@
 
 #import <Foundation/Foundation.h>
 
+#include "../common/FileReader.h"
+
 #if ! __has_feature(objc_arc)
 #error "ARC is off"
 #endif
@@ -29,16 +31,45 @@ HTTPSClient::Reply NSURLClient::request(const HTTPSClient::Request &req)
 	NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:url];
 
 	NSData *bodydata = nil;
+	std::string collected;
 	[request setHTTPMethod:@(req.method.c_str())];
 
-	if (req.postdata.size() > 0 && (req.method != "GET" && req.method != "HEAD"))
+	if (req.hasBody() && (req.method != "GET" && req.method != "HEAD"))
 	{
-		bodydata = [NSData dataWithBytesNoCopy:(void*) req.postdata.data() length:req.postdata.size() freeWhenDone:NO];
-		[request setHTTPBody:bodydata];
+		if (!req.postfile.empty())
+		{
+			// Streamed from disk by the session
+			FileReader file(req.postfile);
+			[request setHTTPBodyStream:[NSInputStream inputStreamWithFileAtPath:@(req.postfile.c_str())]];
+			[request setValue:@(std::to_string(file.getSize()).c_str()) forHTTPHeaderField:@"Content-Length"];
+		}
+		else
+		{
+			StringRef postdata = req.postdata;
+			if (req.source)
+			{
+				if (!readBody(req, collected))
+				{
+					HTTPSClient::Reply reply;
+					reply.responseCode = 0;
+					return reply;
+				}
+
+				postdata = collected;
+			}
+
+			bodydata = [NSData dataWithBytesNoCopy:(void*) postdata.data length:postdata.size freeWhenDone:NO];
+			[request setHTTPBody:bodydata];
+		}
 	}
 
-	for (auto &header : req.headers)
-		[request setValue:@(header.second.c_str()) forHTTPHeaderField:@(header.first.c_str())];
+	for (const auto &header : req.headers)
+		[request setValue:@(header.value.str().c_str()) forHTTPHeaderField:@(header.name.str().c_str())];
+
+	// The session's timeout is for any wait on the server, connecting included
+	auto idleTimeout = req.idleTimeout.count() > 0 ? req.idleTimeout : req.connectTimeout;
+	if (idleTimeout.count() > 0)
+		[request setTimeoutInterval:idleTimeout.count() / 1000.0];
 
 	__block NSHTTPURLResponse *response = nil;
 	__block NSError *error = nil;
@@ -56,7 +87,23 @@ HTTPSClient::Reply NSURLClient::request(const HTTPSClient::Request &req)
 
 	[task resume];
 
-	dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
+	// The whole request is limited here, cancelling still runs the handler
+	bool timedOut = false;
+	if (req.timeout.count() > 0)
+	{
+		dispatch_time_t deadline = dispatch_time(DISPATCH_TIME_NOW, (int64_t) req.timeout.count() * NSEC_PER_MSEC);
+		if (dispatch_semaphore_wait(sem, deadline) != 0)
+		{
+			timedOut = true;
+			[task cancel];
+			dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
+		}
+	}
+	else
+		dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
+
+	if (timedOut || (error != nil && [error.domain isEqualToString:NSURLErrorDomain] && error.code == NSURLErrorTimedOut))
+		throw HTTPSClient::TimeoutError();
 
 	HTTPSClient::Reply reply;
 	reply.responseCode = 0;
@@ -74,7 +121,7 @@ HTTPSClient::Reply NSURLClient::request(const HTTPSClient::Request &req)
 		for (NSString *key in headers)
 		{
 			NSString *value = headers[key];
-			reply.headers[toCppString(key)] = toCppString(value);
+			reply.headers.set(toCppString(key), toCppString(value));
 		}
 	}
 
@@ -82,6 +129,11 @@ HTTPSClient::Reply NSURLClient::request(const HTTPSClient::Request &req)
 	{
 		reply.body = toCppString(error.localizedDescription);
 	}
+	else if (reply.responseCode != 0)
+	{
+		// The data task only hands us the body once it is complete
+		deliver(req, reply);
+	}
 
 	return reply;
 }}
@@ -0,0 +1,69 @@
+#include "AsyncRequest.h"
+
+AsyncRequest::AsyncRequest(const HTTPSClient::Request &req)
+	: request(req)
+	, hasError(false)
+	, done(false)
+{
+	reply.responseCode = 0;
+}
+
+const HTTPSClient::Request &AsyncRequest::getRequest() const
+{
+	return request;
+}
+
+bool AsyncRequest::isDone() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return done;
+}
+
+void AsyncRequest::wait() const
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	finished.wait(lock, [this]() { return done; });
+}
+
+bool AsyncRequest::failed() const
+{
+	return hasError;
+}
+
+const HTTPSClient::Reply &AsyncRequest::getReply() const
+{
+	return reply;
+}
+
+HTTPSClient::Reply &AsyncRequest::getReply()
+{
+	return reply;
+}
+
+const std::string &AsyncRequest::getError() const
+{
+	return error;
+}
+
+void AsyncRequest::complete(HTTPSClient::Reply &&reply)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->reply = std::move(reply);
+		done = true;
+	}
+
+	finished.notify_all();
+}
+
+void AsyncRequest::fail(const std::string &error)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->error = error;
+		hasError = true;
+		done = true;
+	}
+
+	finished.notify_all();
+}
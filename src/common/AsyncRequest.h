@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+#include "HTTPSClient.h"
+
+// A request that runs on a background thread. The submitting thread polls it
+// and only reads the reply once it is done.
+class AsyncRequest
+{
+public:
+	AsyncRequest(const HTTPSClient::Request &req);
+
+	const HTTPSClient::Request &getRequest() const;
+
+	bool isDone() const;
+	void wait() const;
+
+	// Only valid once done
+	bool failed() const;
+	const HTTPSClient::Reply &getReply() const;
+	HTTPSClient::Reply &getReply();
+	const std::string &getError() const;
+
+	void complete(HTTPSClient::Reply &&reply);
+	void fail(const std::string &error);
+
+private:
+	HTTPSClient::Request request;
+	HTTPSClient::Reply reply;
+	std::string error;
+	bool hasError;
+
+	mutable std::mutex mutex;
+	mutable std::condition_variable finished;
+	bool done;
+};
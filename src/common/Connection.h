@@ -1,14 +1,96 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <string>
 
+#include "FileReader.h"
+
 class Connection
 {
 public:
+	typedef std::chrono::steady_clock clock;
+
+	// One piece of a gathered write, like struct iovec
+	struct Buffer
+	{
+		const char *data;
+		size_t size;
+	};
+
+	// When the phases of the last connect ended. Those that didn't happen,
+	// like a handshake on a plain connection, are left at time_point().
+	struct ConnectTimes
+	{
+		clock::time_point resolved;
+		clock::time_point connected;
+		clock::time_point secured;
+	};
+
+	// Limits what follows, including connect: nothing continues past the
+	// deadline, and no wait for the peer takes longer than idle. A deadline
+	// of clock::time_point::max() and an idle of zero mean no limit.
+	virtual void setTimeouts(clock::time_point deadline, std::chrono::milliseconds idle) { (void) deadline; (void) idle; }
+	// Whether the last operation gave up because of the timeouts
+	virtual bool timedOut() const { return false; }
+
 	virtual bool connect(const std::string &hostname, uint16_t port) = 0;
 	virtual size_t read(char *buffer, size_t size) = 0;
 	virtual size_t write(const char *buffer, size_t size) = 0;
 	virtual void close() = 0;
+	// Sends the buffers one after the other, returns false if the connection
+	// failed before all of them were sent
+	virtual bool writeAll(const Buffer *buffers, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			const char *data = buffers[i].data;
+			size_t size = buffers[i].size;
+
+			while (size > 0)
+			{
+				size_t written = write(data, size);
+				if (written == 0)
+					return false;
+
+				data += written;
+				size -= written;
+			}
+		}
+
+		return true;
+	}
+	// Sends the next count bytes of the file, returns how many were sent
+	virtual uint64_t writeFile(FileReader &file, uint64_t count)
+	{
+		char buffer[8192];
+		uint64_t sent = 0;
+
+		while (sent < count)
+		{
+			size_t read = file.read(buffer, (size_t) std::min<uint64_t>(count - sent, sizeof(buffer)));
+			if (read == 0)
+				break;
+
+			for (size_t offset = 0; offset < read; )
+			{
+				size_t written = write(buffer + offset, read - offset);
+				if (written == 0)
+					return sent;
+
+				offset += written;
+				sent += written;
+			}
+		}
+
+		return sent;
+	}
+	// Whether the last read returned nothing because of an error, rather than
+	// the peer closing the connection
+	virtual bool readFailed() const { return false; }
+	// Whether an idle connection can still be used for another request
+	virtual bool isAlive() { return false; }
+	virtual ConnectTimes getConnectTimes() const { return ConnectTimes(); }
 	virtual ~Connection() {};
 };
@@ -3,6 +3,7 @@
 #include "HTTPSClient.h"
 #include "HTTPRequest.h"
 #include "Connection.h"
+#include "ConnectionPool.h"
 
 template<typename Connection>
 class ConnectionClient : public HTTPSClient
@@ -13,6 +14,8 @@ public:
 
 private:
 	static Connection *factory();
+
+	ConnectionPool pool;
 };
 
 template<typename Connection>
@@ -30,6 +33,6 @@ Connection *ConnectionClient<Connection>::factory()
 template<typename Connection>
 HTTPSClient::Reply ConnectionClient<Connection>::request(const HTTPSClient::Request &req)
 {
-	HTTPRequest request(factory);
+	HTTPRequest request(factory, &pool);
 	return request.request(req);
 }
@@ -0,0 +1,79 @@
+#include "ConnectionPool.h"
+
+ConnectionPool::ConnectionPool(size_t maxIdle, clock::duration idleTimeout)
+	: maxIdle(maxIdle)
+	, idleTimeout(idleTimeout)
+{
+}
+
+std::string ConnectionPool::makeOrigin(const std::string &schema, const std::string &hostname, uint16_t port)
+{
+	return schema + "://" + hostname + ":" + std::to_string(port);
+}
+
+std::unique_ptr<Connection> ConnectionPool::acquire(const std::string &schema, const std::string &hostname, uint16_t port)
+{
+	std::string origin = makeOrigin(schema, hostname, port);
+	auto now = clock::now();
+
+	// Connections are destroyed outside the lock, closing them may block
+	std::list<IdleConnection> discarded;
+	std::unique_ptr<Connection> result;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (auto it = idle.begin(); it != idle.end(); )
+		{
+			auto current = it++;
+			if (now - current->since > idleTimeout)
+			{
+				discarded.splice(discarded.end(), idle, current);
+				continue;
+			}
+
+			if (result || current->origin != origin)
+				continue;
+
+			discarded.splice(discarded.end(), idle, current);
+			result = std::move(discarded.back().conn);
+		}
+	}
+
+	// The peer may have closed the connection while it was idle
+	if (result && !result->isAlive())
+		result.reset();
+
+	return result;
+}
+
+void ConnectionPool::release(const std::string &schema, const std::string &hostname, uint16_t port, std::unique_ptr<Connection> conn)
+{
+	if (maxIdle == 0)
+		return;
+
+	IdleConnection entry;
+	entry.origin = makeOrigin(schema, hostname, port);
+	entry.conn = std::move(conn);
+	entry.since = clock::now();
+
+	std::list<IdleConnection> discarded;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		idle.push_front(std::move(entry));
+
+		if (idle.size() > maxIdle)
+			discarded.splice(discarded.end(), idle, std::prev(idle.end()));
+	}
+}
+
+void ConnectionPool::clear()
+{
+	std::list<IdleConnection> discarded;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		discarded.swap(idle);
+	}
+}
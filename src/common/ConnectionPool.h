@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Connection.h"
+
+// Keeps idle keep-alive connections around so that later requests to the
+// same origin can skip the TCP and TLS handshakes.
+class ConnectionPool
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	ConnectionPool(size_t maxIdle = 16, clock::duration idleTimeout = std::chrono::seconds(30));
+
+	// Returns a live idle connection to the origin, or nullptr if there is none
+	std::unique_ptr<Connection> acquire(const std::string &schema, const std::string &hostname, uint16_t port);
+	void release(const std::string &schema, const std::string &hostname, uint16_t port, std::unique_ptr<Connection> conn);
+	void clear();
+
+private:
+	struct IdleConnection
+	{
+		std::string origin;
+		std::unique_ptr<Connection> conn;
+		clock::time_point since;
+	};
+
+	static std::string makeOrigin(const std::string &schema, const std::string &hostname, uint16_t port);
+
+	size_t maxIdle;
+	clock::duration idleTimeout;
+
+	std::mutex mutex;
+	// Most recently released first
+	std::list<IdleConnection> idle;
+};
@@ -0,0 +1,425 @@
+#include "ContentDecoder.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+
+#include "LibraryLoader.h"
+
+// The libraries are loaded at runtime, their headers may not be around at
+// build time. These match their stable ABIs.
+namespace
+{
+	struct ZStream
+	{
+		const unsigned char *next_in;
+		unsigned int avail_in;
+		unsigned long total_in;
+		unsigned char *next_out;
+		unsigned int avail_out;
+		unsigned long total_out;
+		const char *msg;
+		void *state;
+		void *zalloc;
+		void *zfree;
+		void *opaque;
+		int data_type;
+		unsigned long adler;
+		unsigned long reserved;
+	};
+
+	const int Z_OK = 0;
+	const int Z_STREAM_END = 1;
+	const int Z_BUF_ERROR = -5;
+	const int Z_NO_FLUSH = 0;
+
+	enum BrotliResult
+	{
+		BROTLI_RESULT_ERROR = 0,
+		BROTLI_RESULT_SUCCESS = 1,
+		BROTLI_RESULT_NEEDS_MORE_INPUT = 2,
+		BROTLI_RESULT_NEEDS_MORE_OUTPUT = 3,
+	};
+
+	struct ZstdInBuffer
+	{
+		const void *src;
+		size_t size;
+		size_t pos;
+	};
+
+	struct ZstdOutBuffer
+	{
+		void *dst;
+		size_t size;
+		size_t pos;
+	};
+
+	struct Codecs
+	{
+		Codecs();
+
+		bool zlib;
+		const char *(*zlibVersion)();
+		int (*inflateInit2_)(ZStream *stream, int windowBits, const char *version, int streamSize);
+		int (*inflate)(ZStream *stream, int flush);
+		int (*inflateEnd)(ZStream *stream);
+
+		bool brotli;
+		void *(*BrotliDecoderCreateInstance)(void *alloc, void *free, void *opaque);
+		BrotliResult (*BrotliDecoderDecompressStream)(void *state, size_t *availableIn, const uint8_t **nextIn, size_t *availableOut, uint8_t **nextOut, size_t *totalOut);
+		void (*BrotliDecoderDestroyInstance)(void *state);
+
+		bool zstd;
+		void *(*ZSTD_createDStream)();
+		size_t (*ZSTD_freeDStream)(void *stream);
+		size_t (*ZSTD_initDStream)(void *stream);
+		size_t (*ZSTD_decompressStream)(void *stream, ZstdOutBuffer *output, ZstdInBuffer *input);
+		unsigned (*ZSTD_isError)(size_t code);
+
+		std::string acceptEncoding;
+	};
+
+	LibraryLoader::handle *openFirst(std::initializer_list<const char *> names)
+	{
+		for (const char *name : names)
+		{
+			LibraryLoader::handle *handle = LibraryLoader::OpenLibrary(name);
+			if (handle)
+				return handle;
+		}
+
+		return nullptr;
+	}
+
+	Codecs::Codecs()
+		: zlib(false)
+		, brotli(false)
+		, zstd(false)
+	{
+		using namespace LibraryLoader;
+
+		// Kept open for the lifetime of the process
+#ifdef _WIN32
+		handle *zlibHandle = openFirst({"zlib1.dll", "zlib.dll"});
+		handle *brotliHandle = openFirst({"brotlidec.dll", "libbrotlidec.dll"});
+		handle *zstdHandle = openFirst({"libzstd.dll", "zstd.dll"});
+#else
+		handle *zlibHandle = openFirst({"libz.so.1", "libz.so"});
+		handle *brotliHandle = openFirst({"libbrotlidec.so.1", "libbrotlidec.so"});
+		handle *zstdHandle = openFirst({"libzstd.so.1", "libzstd.so"});
+#endif
+
+		zlib = zlibHandle
+			&& LoadSymbol(zlibVersion, zlibHandle, "zlibVersion")
+			&& LoadSymbol(inflateInit2_, zlibHandle, "inflateInit2_")
+			&& LoadSymbol(inflate, zlibHandle, "inflate")
+			&& LoadSymbol(inflateEnd, zlibHandle, "inflateEnd");
+
+		brotli = brotliHandle
+			&& LoadSymbol(BrotliDecoderCreateInstance, brotliHandle, "BrotliDecoderCreateInstance")
+			&& LoadSymbol(BrotliDecoderDecompressStream, brotliHandle, "BrotliDecoderDecompressStream")
+			&& LoadSymbol(BrotliDecoderDestroyInstance, brotliHandle, "BrotliDecoderDestroyInstance");
+
+		zstd = zstdHandle
+			&& LoadSymbol(ZSTD_createDStream, zstdHandle, "ZSTD_createDStream")
+			&& LoadSymbol(ZSTD_freeDStream, zstdHandle, "ZSTD_freeDStream")
+			&& LoadSymbol(ZSTD_initDStream, zstdHandle, "ZSTD_initDStream")
+			&& LoadSymbol(ZSTD_decompressStream, zstdHandle, "ZSTD_decompressStream")
+			&& LoadSymbol(ZSTD_isError, zstdHandle, "ZSTD_isError");
+
+		// Best compression first, servers tend to pick the first they know
+		if (zstd)
+			acceptEncoding += "zstd, ";
+		if (brotli)
+			acceptEncoding += "br, ";
+		if (zlib)
+			acceptEncoding += "gzip, deflate, ";
+		if (!acceptEncoding.empty())
+			acceptEncoding.resize(acceptEncoding.size() - 2);
+	}
+
+	Codecs &getCodecs()
+	{
+		// Loaded on first use, most programs never ask for compressed responses
+		static Codecs codecs;
+		return codecs;
+	}
+
+	// gzip, and deflate with or without its zlib wrapper
+	class ZlibDecoder : public ContentDecoder
+	{
+	public:
+		ZlibDecoder(bool gzip, Output output)
+			: ContentDecoder(output)
+			, codecs(getCodecs())
+			, gzip(gzip)
+			, initialized(false)
+			, ended(false)
+		{
+		}
+
+		~ZlibDecoder()
+		{
+			if (initialized)
+				codecs.inflateEnd(&stream);
+		}
+
+	protected:
+		bool decode(const char *data, size_t size) override
+		{
+			if (!initialized)
+			{
+				// Some servers send deflate without the zlib header, which always starts with 0x?8
+				int windowBits = gzip ? 16 + 15 : ((data[0] & 0x0f) == 8 ? 15 : -15);
+
+				std::fill((char *) &stream, (char *) &stream + sizeof(stream), 0);
+				if (codecs.inflateInit2_(&stream, windowBits, codecs.zlibVersion(), (int) sizeof(stream)) != Z_OK)
+					return false;
+				initialized = true;
+			}
+
+			// Anything after the end of the stream is ignored
+			if (ended)
+				return true;
+
+			stream.next_in = (const unsigned char *) data;
+			stream.avail_in = (unsigned int) size;
+
+			char buffer[chunkSize];
+			do
+			{
+				stream.next_out = (unsigned char *) buffer;
+				stream.avail_out = sizeof(buffer);
+
+				int result = codecs.inflate(&stream, Z_NO_FLUSH);
+				if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+					return false;
+
+				if (!emit(buffer, sizeof(buffer) - stream.avail_out))
+					return false;
+
+				if (result == Z_STREAM_END)
+				{
+					ended = true;
+					break;
+				}
+			}
+			while (stream.avail_in > 0 || stream.avail_out == 0);
+
+			return true;
+		}
+
+		bool complete() const override
+		{
+			return ended;
+		}
+
+	private:
+		Codecs &codecs;
+		ZStream stream;
+		bool gzip;
+		bool initialized;
+		bool ended;
+	};
+
+	class BrotliDecoder : public ContentDecoder
+	{
+	public:
+		BrotliDecoder(Output output)
+			: ContentDecoder(output)
+			, codecs(getCodecs())
+			, state(codecs.BrotliDecoderCreateInstance(nullptr, nullptr, nullptr))
+			, ended(false)
+		{
+		}
+
+		~BrotliDecoder()
+		{
+			if (state)
+				codecs.BrotliDecoderDestroyInstance(state);
+		}
+
+	protected:
+		bool decode(const char *data, size_t size) override
+		{
+			if (!state)
+				return false;
+
+			if (ended)
+				return true;
+
+			const uint8_t *nextIn = (const uint8_t *) data;
+			size_t availableIn = size;
+			char buffer[chunkSize];
+
+			while (true)
+			{
+				uint8_t *nextOut = (uint8_t *) buffer;
+				size_t availableOut = sizeof(buffer);
+
+				BrotliResult result = codecs.BrotliDecoderDecompressStream(state, &availableIn, &nextIn, &availableOut, &nextOut, nullptr);
+				if (result == BROTLI_RESULT_ERROR)
+					return false;
+
+				if (!emit(buffer, sizeof(buffer) - availableOut))
+					return false;
+
+				if (result == BROTLI_RESULT_SUCCESS)
+				{
+					ended = true;
+					return true;
+				}
+
+				if (result == BROTLI_RESULT_NEEDS_MORE_INPUT)
+					return true;
+			}
+		}
+
+		bool complete() const override
+		{
+			return ended;
+		}
+
+	private:
+		Codecs &codecs;
+		void *state;
+		bool ended;
+	};
+
+	class ZstdDecoder : public ContentDecoder
+	{
+	public:
+		ZstdDecoder(Output output)
+			: ContentDecoder(output)
+			, codecs(getCodecs())
+			, stream(codecs.ZSTD_createDStream())
+			, frameDone(false)
+		{
+			if (stream && codecs.ZSTD_isError(codecs.ZSTD_initDStream(stream)))
+			{
+				codecs.ZSTD_freeDStream(stream);
+				stream = nullptr;
+			}
+		}
+
+		~ZstdDecoder()
+		{
+			if (stream)
+				codecs.ZSTD_freeDStream(stream);
+		}
+
+	protected:
+		bool decode(const char *data, size_t size) override
+		{
+			if (!stream)
+				return false;
+
+			ZstdInBuffer input = {data, size, 0};
+			char buffer[chunkSize];
+
+			// Loop until the input is used up and the output buffer wasn't filled
+			while (true)
+			{
+				ZstdOutBuffer output = {buffer, sizeof(buffer), 0};
+
+				size_t result = codecs.ZSTD_decompressStream(stream, &output, &input);
+				if (codecs.ZSTD_isError(result))
+					return false;
+
+				// A body may hold several frames, 0 means the last one is complete
+				frameDone = result == 0;
+
+				if (!emit(buffer, output.pos))
+					return false;
+
+				if (input.pos == input.size && output.pos < output.size)
+					return true;
+			}
+		}
+
+		bool complete() const override
+		{
+			return frameDone;
+		}
+
+	private:
+		Codecs &codecs;
+		void *stream;
+		bool frameDone;
+	};
+
+	std::string toLower(const std::string &str)
+	{
+		std::string lower = str;
+		for (char &c : lower)
+			c = (char) std::tolower((unsigned char) c);
+		return lower;
+	}
+}
+
+const std::string &ContentDecoder::getAcceptEncoding()
+{
+	return getCodecs().acceptEncoding;
+}
+
+std::unique_ptr<ContentDecoder> ContentDecoder::create(const std::string &encoding, Output output)
+{
+	Codecs &codecs = getCodecs();
+
+	size_t start = encoding.find_first_not_of(" \t");
+	size_t end = encoding.find_last_not_of(" \t");
+	std::string name = start == std::string::npos ? "" : toLower(encoding.substr(start, end - start + 1));
+
+	// Only a single coding is undone, a list of them is passed on as is
+	if ((name == "gzip" || name == "x-gzip") && codecs.zlib)
+		return std::unique_ptr<ContentDecoder>(new ZlibDecoder(true, output));
+	if (name == "deflate" && codecs.zlib)
+		return std::unique_ptr<ContentDecoder>(new ZlibDecoder(false, output));
+	if (name == "br" && codecs.brotli)
+		return std::unique_ptr<ContentDecoder>(new BrotliDecoder(output));
+	if (name == "zstd" && codecs.zstd)
+		return std::unique_ptr<ContentDecoder>(new ZstdDecoder(output));
+
+	return nullptr;
+}
+
+ContentDecoder::ContentDecoder(Output output)
+	: output(output)
+	, empty(true)
+	, corrupt(false)
+	, stopped(false)
+{
+}
+
+bool ContentDecoder::write(const char *data, size_t size)
+{
+	if (failed())
+		return false;
+
+	if (size == 0)
+		return true;
+
+	empty = false;
+	if (!decode(data, size) && !stopped)
+		corrupt = true;
+
+	return !failed();
+}
+
+bool ContentDecoder::finish()
+{
+	if (!failed() && !empty && !complete())
+		corrupt = true;
+
+	return !failed();
+}
+
+bool ContentDecoder::emit(const char *data, size_t size)
+{
+	if (size == 0 || output(data, size))
+		return true;
+
+	stopped = true;
+	return false;
+}
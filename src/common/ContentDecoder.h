@@ -0,0 +1,47 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+// Undoes the Content-Encoding of a response body as it arrives. zlib, brotli
+// and zstd are loaded when first needed, encodings whose library is missing
+// are neither offered nor decoded.
+class ContentDecoder
+{
+public:
+	// Receives the decoded body, returning false stops decoding
+	typedef std::function<bool(const char *data, size_t size)> Output;
+
+	// The value for Accept-Encoding, empty if there is nothing we can decode
+	static const std::string &getAcceptEncoding();
+	// Returns nullptr if the encoding is identity or can't be decoded
+	static std::unique_ptr<ContentDecoder> create(const std::string &encoding, Output output);
+
+	virtual ~ContentDecoder() {}
+
+	// Returns false if the data is corrupt or the output stopped
+	bool write(const char *data, size_t size);
+	// Whether the encoded stream was complete, an empty body is
+	bool finish();
+
+	bool failed() const { return corrupt || stopped; }
+	bool aborted() const { return stopped; }
+
+protected:
+	ContentDecoder(Output output);
+
+	// Decodes the input, handing the results to emit. Returns false if it is corrupt.
+	virtual bool decode(const char *data, size_t size) = 0;
+	virtual bool complete() const = 0;
+
+	bool emit(const char *data, size_t size);
+
+	static const size_t chunkSize = 16384;
+
+private:
+	Output output;
+	bool empty;
+	bool corrupt;
+	bool stopped;
+};
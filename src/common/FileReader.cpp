@@ -0,0 +1,91 @@
+#include "config.h"
+#include "FileReader.h"
+
+#include <stdexcept>
+
+#if defined(WIN32) || defined(_WIN32)
+#	include <algorithm>
+#	include <windows.h>
+#else
+#	include <cerrno>
+#	include <cstring>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/stat.h>
+#endif
+
+#if defined(WIN32) || defined(_WIN32)
+
+FileReader::FileReader(const std::string &path)
+	: size(0)
+{
+	int wideSize = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+	std::wstring widePath(wideSize > 0 ? wideSize : 1, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &widePath[0], wideSize);
+
+	HANDLE file = CreateFileW(widePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Could not open " + path);
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		CloseHandle(file);
+		throw std::runtime_error("Could not open " + path);
+	}
+
+	handle = file;
+	size = (uint64_t) fileSize.QuadPart;
+}
+
+FileReader::~FileReader()
+{
+	CloseHandle((HANDLE) handle);
+}
+
+size_t FileReader::read(char *buffer, size_t count)
+{
+	DWORD readBytes = 0;
+	if (!ReadFile((HANDLE) handle, buffer, (DWORD) std::min<size_t>(count, 0x40000000), &readBytes, nullptr))
+		return 0;
+
+	return readBytes;
+}
+
+#else
+
+FileReader::FileReader(const std::string &path)
+	: size(0)
+{
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+	{
+		close(fd);
+		throw std::runtime_error("Could not open " + path + ": not a regular file");
+	}
+
+	size = (uint64_t) info.st_size;
+}
+
+FileReader::~FileReader()
+{
+	close(fd);
+}
+
+size_t FileReader::read(char *buffer, size_t count)
+{
+	while (true)
+	{
+		ssize_t readBytes = ::read(fd, buffer, count);
+		if (readBytes >= 0)
+			return (size_t) readBytes;
+		if (errno != EINTR)
+			return 0;
+	}
+}
+
+#endif
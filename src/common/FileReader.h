@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Reads a file sequentially, for sending it as a request body
+class FileReader
+{
+public:
+	// Throws if the file can't be opened
+	FileReader(const std::string &path);
+	~FileReader();
+
+	uint64_t getSize() const { return size; }
+	// Returns 0 at the end of the file or on failure
+	size_t read(char *buffer, size_t count);
+
+#if !(defined(WIN32) || defined(_WIN32))
+	// For handing the file to the kernel, reads through it advance the same offset
+	int getFd() const { return fd; }
+#endif
+
+private:
+	FileReader(const FileReader &) = delete;
+	FileReader &operator=(const FileReader &) = delete;
+
+	uint64_t size;
+
+#if defined(WIN32) || defined(_WIN32)
+	void *handle;
+#else
+	int fd;
+#endif
+};
@@ -0,0 +1,167 @@
+#include "config.h"
+#include "FileWriter.h"
+
+#include <stdexcept>
+
+#if defined(WIN32) || defined(_WIN32)
+#	include <algorithm>
+#	include <windows.h>
+#else
+#	include <atomic>
+#	include <cerrno>
+#	include <cstring>
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
+
+#if defined(WIN32) || defined(_WIN32)
+
+static std::wstring toWide(const std::string &str)
+{
+	int size = MultiByteToWideChar(CP_UTF8, 0, str.c_str(), -1, nullptr, 0);
+	if (size <= 0)
+		return std::wstring();
+
+	std::wstring wide(size, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, str.c_str(), -1, &wide[0], size);
+	wide.resize(size - 1);
+	return wide;
+}
+
+FileWriter::FileWriter(const std::string &path)
+	: path(path)
+	, tempPath(path + ".part")
+	, writeFailed(false)
+{
+	HANDLE file = CreateFileW(toWide(tempPath).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Could not create " + tempPath);
+
+	handle = file;
+}
+
+FileWriter::~FileWriter()
+{
+	discard();
+}
+
+bool FileWriter::write(const char *data, size_t size)
+{
+	while (size > 0 && !writeFailed)
+	{
+		DWORD written = 0;
+		DWORD chunk = (DWORD) std::min<size_t>(size, 0x40000000);
+		if (!WriteFile((HANDLE) handle, data, chunk, &written, nullptr))
+			writeFailed = true;
+
+		data += written;
+		size -= written;
+	}
+
+	return !writeFailed;
+}
+
+void FileWriter::commit()
+{
+	if (!handle)
+		throw std::runtime_error("Download was already committed");
+
+	bool flushed = !writeFailed && FlushFileBuffers((HANDLE) handle);
+	CloseHandle((HANDLE) handle);
+	handle = nullptr;
+
+	if (!flushed || !MoveFileExW(toWide(tempPath).c_str(), toWide(path).c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		DeleteFileW(toWide(tempPath).c_str());
+		throw std::runtime_error("Could not write " + path);
+	}
+}
+
+void FileWriter::discard()
+{
+	if (!handle)
+		return;
+
+	CloseHandle((HANDLE) handle);
+	handle = nullptr;
+	DeleteFileW(toWide(tempPath).c_str());
+}
+
+#else
+
+FileWriter::FileWriter(const std::string &path)
+	: path(path)
+	, writeFailed(false)
+{
+	static std::atomic<unsigned> counter(0);
+
+	// The temporary file lives in the same directory, so rename() can't cross
+	// file systems. Not mkstemp, its files don't get the umask's permissions.
+	tempPath = path + "." + std::to_string(getpid()) + "-" + std::to_string(counter++) + ".part";
+	fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0)
+		throw std::runtime_error("Could not create a temporary file for " + path + ": " + strerror(errno));
+}
+
+FileWriter::~FileWriter()
+{
+	discard();
+}
+
+bool FileWriter::write(const char *data, size_t size)
+{
+	while (size > 0 && !writeFailed)
+	{
+		ssize_t written = ::write(fd, data, size);
+		if (written < 0)
+		{
+			if (errno != EINTR)
+				writeFailed = true;
+			continue;
+		}
+
+		data += written;
+		size -= (size_t) written;
+	}
+
+	return !writeFailed;
+}
+
+void FileWriter::commit()
+{
+	if (fd < 0)
+		throw std::runtime_error("Download was already committed");
+
+	bool flushed = !writeFailed && fsync(fd) == 0;
+	flushed = close(fd) == 0 && flushed;
+	fd = -1;
+
+	if (!flushed || rename(tempPath.c_str(), path.c_str()) != 0)
+	{
+		std::string error = strerror(errno);
+		unlink(tempPath.c_str());
+		throw std::runtime_error("Could not write " + path + ": " + error);
+	}
+
+	// Make the rename itself durable
+	size_t slash = path.rfind('/');
+	std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	int dirfd = open(directory.c_str(), O_RDONLY);
+	if (dirfd >= 0)
+	{
+		fsync(dirfd);
+		close(dirfd);
+	}
+}
+
+void FileWriter::discard()
+{
+	if (fd < 0)
+		return;
+
+	close(fd);
+	fd = -1;
+	unlink(tempPath.c_str());
+}
+
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+// Writes to a temporary file next to the destination, which only replaces the
+// destination once commit() has flushed it to disk. Anything not committed is
+// removed again.
+class FileWriter
+{
+public:
+	// Throws if the temporary file can't be created
+	FileWriter(const std::string &path);
+	~FileWriter();
+
+	bool write(const char *data, size_t size);
+	// Throws if the data can't be flushed or moved into place
+	void commit();
+
+	bool failed() const { return writeFailed; }
+	const std::string &getPath() const { return path; }
+
+private:
+	FileWriter(const FileWriter &) = delete;
+	FileWriter &operator=(const FileWriter &) = delete;
+
+	void discard();
+
+	std::string path;
+	std::string tempPath;
+	bool writeFailed;
+
+#if defined(WIN32) || defined(_WIN32)
+	void *handle;
+#else
+	int fd;
+#endif
+};
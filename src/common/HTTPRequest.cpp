@@ -1,14 +1,55 @@
-#include <sstream>
+#include <algorithm>
+#include <cstdio>
 #include <string>
 #include <memory>
-#include <limits>
 #include <stdexcept>
 
+#include "ContentDecoder.h"
 #include "HTTPRequest.h"
+#include "HTTPResponseParser.h"
 #include "PlaintextConnection.h"
+#include "Stats.h"
 
-HTTPRequest::HTTPRequest(ConnectionFactory factory)
+// Hands the body to the request's sink, or collects it in the reply
+struct BodyWriter
+{
+	BodyWriter(const HTTPSClient::Request &req, HTTPSClient::Reply &reply)
+		: req(req)
+		, reply(reply)
+	{
+	}
+
+	const HTTPSClient::Request &req;
+	HTTPSClient::Reply &reply;
+	bool aborted = false;
+
+	bool write(const char *data, size_t size)
+	{
+		if (aborted || size == 0)
+			return !aborted;
+
+		reply.bodySize += size;
+		if (req.sink)
+			aborted = !req.sink(data, size);
+		else
+			reply.body.append(data, size);
+
+		return !aborted;
+	}
+};
+
+// For timings, phases that didn't happen count as 0
+static double secondsSince(Connection::clock::time_point start, Connection::clock::time_point end)
+{
+	if (end == Connection::clock::time_point())
+		return 0.0;
+
+	return std::chrono::duration<double>(end - start).count();
+}
+
+HTTPRequest::HTTPRequest(ConnectionFactory factory, ConnectionPool *pool)
 	: factory(factory)
+	, pool(pool)
 {
 }
 
@@ -21,87 +62,270 @@ HTTPSClient::Reply HTTPRequest::request(const HTTPSClient::Request &req)
 	if (!info.valid)
 		return reply;
 
-	std::unique_ptr<Connection> conn;
-	if (info.schema == "http")
-		conn.reset(new PlaintextConnection());
-	else if (info.schema == "https")
-		conn.reset(factory());
-	else
+	if (info.schema != "http" && info.schema != "https")
 		throw std::runtime_error("Unknown url schema");
 
-	if (!conn->connect(info.hostname, info.port))
-		return reply;
+	std::unique_ptr<Connection> conn;
+	ExchangeResult result = EXCHANGE_NO_RESPONSE;
 
-	// Build the request
-	{
-		std::stringstream request;
-		std::string method = req.method;
-		bool hasData = req.postdata.length() > 0;
+	auto start = Connection::clock::now();
+	auto deadline = Connection::clock::time_point::max();
+	if (req.timeout.count() > 0)
+		deadline = start + req.timeout;
+
+	auto connectDeadline = deadline;
+	if (req.connectTimeout.count() > 0)
+		connectDeadline = std::min(deadline, start + req.connectTimeout);
 
-		if (method.length() == 0)
-			method = hasData ? "POST" : "GET";
+	// A body from a source can't be sent twice, so don't risk a stale connection
+	if (pool && !req.source)
+		conn = pool->acquire(info.schema, info.hostname, info.port);
 
-		request << method << " " << info.query << " HTTP/1.1\r\n";
+	if (conn)
+	{
+		reply.timings.reused = true;
+		conn->setTimeouts(deadline, req.idleTimeout);
+		result = exchange(conn.get(), info, req, reply, start);
 
-		for (auto &header : req.headers)
-			request << header.first << ": " << header.second << "\r\n";
+		if (conn->timedOut())
+			throw HTTPSClient::TimeoutError();
 
-		request << "Connection: Close\r\n";
+		// The server closed the idle connection before it saw our request, try again on a new one
+		if (result == EXCHANGE_NO_RESPONSE)
+		{
+			conn.reset();
+			reply = HTTPSClient::Reply();
+			reply.responseCode = 0;
+		}
+		else
+			Stats::add(Stats::CONNECTIONS_REUSED);
+	}
 
-		request << "Host: " << info.hostname << "\r\n";
+	if (!conn)
+	{
+		if (info.schema == "http")
+			conn.reset(new PlaintextConnection());
+		else
+			conn.reset(factory());
 
-		if (hasData)
-			request << "Content-Length: " << req.postdata.size() << "\r\n";
+		conn->setTimeouts(connectDeadline, std::chrono::milliseconds(0));
+		if (!conn->connect(info.hostname, info.port))
+		{
+			if (conn->timedOut())
+				throw HTTPSClient::TimeoutError();
+			return reply;
+		}
 
-		request << "\r\n";
+		Connection::ConnectTimes times = conn->getConnectTimes();
+		reply.timings.nameLookup = secondsSince(start, times.resolved);
+		reply.timings.connect = secondsSince(start, times.connected);
+		reply.timings.tlsHandshake = secondsSince(start, times.secured);
 
-		if (hasData)
-			request << req.postdata;
+		conn->setTimeouts(deadline, req.idleTimeout);
+		result = exchange(conn.get(), info, req, reply, start);
 
-		// Send it
-		std::string requestData = request.str();
-		conn->write(requestData.c_str(), requestData.size());
+		if (conn->timedOut())
+			throw HTTPSClient::TimeoutError();
 	}
 
-	// Now receive the reply
-	std::stringstream response;
+	reply.timings.total = secondsSince(start, Connection::clock::now());
+
+	if (pool && result == EXCHANGE_KEEP_ALIVE)
+		pool->release(info.schema, info.hostname, info.port, std::move(conn));
+	else
+		conn->close();
+
+	return reply;
+}
+
+HTTPRequest::ExchangeResult HTTPRequest::exchange(Connection *conn, const DissectedURL &info, const HTTPSClient::Request &req, HTTPSClient::Reply &reply, Connection::clock::time_point start)
+{
+	std::string method = req.method;
+	bool hasData = req.hasBody();
+
+	// Opened for every attempt, so a retry starts from the beginning again
+	std::unique_ptr<FileReader> file;
+	if (!req.postfile.empty())
+		file.reset(new FileReader(req.postfile));
+
+	if (method.length() == 0)
+		method = hasData ? "POST" : "GET";
+
+	// The head goes into one buffer sized up front, the body is sent from
+	// where it already is
 	{
-		char buffer[8192];
+		const std::string &acceptEncoding = ContentDecoder::getAcceptEncoding();
+		bool addAcceptEncoding = req.decompress && !req.headers.contains("Accept-Encoding") && !acceptEncoding.empty();
+
+		std::string contentLength;
+		if (file)
+			contentLength = std::to_string(file->getSize());
+		else if (hasData && !req.source)
+			contentLength = std::to_string(req.postdata.size);
 
-		while (true)
+		size_t headSize = method.size() + info.query.size() + 64 + info.hostname.size() + contentLength.size() + acceptEncoding.size();
+		for (auto header : req.headers)
+			headSize += header.name.size + header.value.size + 4;
+
+		std::string head;
+		head.reserve(headSize);
+
+		head.append(method).append(" ").append(info.query).append(" HTTP/1.1\r\n");
+
+		for (auto header : req.headers)
 		{
-			size_t read = conn->read(buffer, sizeof(buffer));
-			response.write(buffer, read);
-			if (read == 0)
-				break;
+			head.append(header.name.data, header.name.size).append(": ");
+			head.append(header.value.data, header.value.size).append("\r\n");
 		}
 
-		conn->close();
+		// Only what we can decode is offered, anything else would arrive as is
+		if (addAcceptEncoding)
+			head.append("Accept-Encoding: ").append(acceptEncoding).append("\r\n");
+
+		// Without a pool there is no point in keeping the connection open
+		if (!pool)
+			head.append("Connection: Close\r\n");
+
+		head.append("Host: ").append(info.hostname).append("\r\n");
+
+		if (!contentLength.empty())
+			head.append("Content-Length: ").append(contentLength).append("\r\n");
+		else if (req.source)
+			head.append("Transfer-Encoding: chunked\r\n");
+
+		head.append("\r\n");
+
+		// A body in memory goes out with the head in a single gathered write
+		Connection::Buffer request[] = {
+			{head.data(), head.size()},
+			{req.postdata.data, hasData && !file && !req.source ? req.postdata.size : 0},
+		};
+
+		if (!conn->writeAll(request, 2))
+			return EXCHANGE_NO_RESPONSE;
+		reply.timings.bytesSent += request[0].size + request[1].size;
+
+		if (file)
+		{
+			uint64_t sent = conn->writeFile(*file, file->getSize());
+			reply.timings.bytesSent += sent;
+			if (sent != file->getSize())
+				return EXCHANGE_NO_RESPONSE;
+		}
+		else if (req.source)
+		{
+			// The last, empty chunk comes out as "0\r\n\r\n", which also ends the (empty) trailers
+			std::string chunk;
+			do
+			{
+				chunk.clear();
+				if (!req.source(chunk))
+					return EXCHANGE_CLOSE;
+
+				char size[24];
+				int sizeLength = snprintf(size, sizeof(size), "%zx\r\n", chunk.size());
+
+				Connection::Buffer pieces[] = {
+					{size, (size_t) sizeLength},
+					{chunk.data(), chunk.size()},
+					{"\r\n", 2},
+				};
+
+				if (!conn->writeAll(pieces, 3))
+					return EXCHANGE_CLOSE;
+				reply.timings.bytesSent += pieces[0].size + pieces[1].size + pieces[2].size;
+			}
+			while (!chunk.empty());
+		}
 	}
 
-	reply.responseCode = 500;
-	// And parse it
+	BodyWriter body(req, reply);
+	std::unique_ptr<ContentDecoder> decoder;
+	HTTPResponseParser parser(method == "HEAD", [&body, &decoder, &reply](const char *data, size_t size) {
+		reply.rawBodySize += size;
+		return decoder ? decoder->write(data, size) : body.write(data, size);
+	});
+
+	char buffer[8192];
+	bool received = false;
+	bool headersSeen = false;
+	bool trailingData = false;
+	bool cutOff = false;
+
+	// Now receive the reply, the parser tells us where it ends
+	while (!parser.done() && !parser.failed())
 	{
-		std::string protocol;
-		response >> protocol;
-		if (protocol != "HTTP/1.1")
-			return reply;
+		size_t read = conn->read(buffer, sizeof(buffer));
+		if (read == 0)
+		{
+			// The server closed the idle connection before it saw our request
+			if (!received)
+				return EXCHANGE_NO_RESPONSE;
+
+			// A body that runs until the close is only complete if the close was clean
+			cutOff = conn->readFailed();
+			if (!cutOff)
+				parser.finish();
+			cutOff = cutOff || parser.failed();
+			break;
+		}
+
+		if (!received)
+			reply.timings.firstByte = secondsSince(start, Connection::clock::now());
 
-		response >> reply.responseCode;
-		response.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+		received = true;
+		reply.timings.bytesReceived += read;
 
-		for (std::string line; getline(response, line, '\n') && line != "\r"; )
+		for (size_t offset = 0; offset < read && !parser.failed(); )
 		{
-			auto sep = line.find(':');
-			reply.headers[line.substr(0, sep)] = line.substr(sep+1, line.size()-sep-1);
+			if (parser.done())
+			{
+				// Whatever follows is not ours to read, don't reuse the connection
+				trailingData = true;
+				break;
+			}
+
+			offset += parser.feed(buffer + offset, read - offset);
+
+			if (!headersSeen && parser.headersComplete())
+			{
+				headersSeen = true;
+				reply.responseCode = parser.getStatus();
+				reply.headers = std::move(parser.getHeaders());
+
+				if (req.onHeaders && !req.onHeaders(reply.responseCode, reply.headers))
+					return EXCHANGE_CLOSE;
+
+				auto encoding = reply.headers.find("Content-Encoding");
+				if (req.decompress && encoding != reply.headers.end())
+				{
+					decoder = ContentDecoder::create(encoding->value.str(), [&body](const char *data, size_t size) {
+						return body.write(data, size);
+					});
+				}
+
+				if (!decoder && method != "HEAD")
+					HTTPSClient::reserveBody(req, reply);
+			}
 		}
-
-		auto begin = std::istreambuf_iterator<char>(response);
-		auto end = std::istreambuf_iterator<char>();
-		reply.body = std::string(begin, end);
 	}
 
-	return reply;
+	// Something came back, but not a response we can make sense of
+	if (!headersSeen)
+		reply.responseCode = 500;
+	else if (cutOff)
+		reply.error = "Connection closed before the response was complete";
+	else if (decoder && decoder->failed() && !decoder->aborted())
+		reply.error = "Could not decode the response body";
+	else if (parser.failed() && !parser.aborted())
+		reply.error = "Malformed response body";
+	else if (decoder && parser.done() && !decoder->finish())
+		reply.error = "Could not decode the response body";
+
+	if (parser.done() && parser.keepAlive() && !trailingData)
+		return EXCHANGE_KEEP_ALIVE;
+
+	return EXCHANGE_CLOSE;
 }
 
 HTTPRequest::DissectedURL HTTPRequest::parseUrl(const std::string &url)
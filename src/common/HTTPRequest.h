@@ -4,6 +4,7 @@
 
 #include "HTTPSClient.h"
 #include "Connection.h"
+#include "ConnectionPool.h"
 
 class HTTPRequest
 {
@@ -19,12 +20,22 @@ public:
 	};
 	typedef std::function<Connection *()> ConnectionFactory;
 
-	HTTPRequest(ConnectionFactory factory);
+	HTTPRequest(ConnectionFactory factory, ConnectionPool *pool = nullptr);
 
 	HTTPSClient::Reply request(const HTTPSClient::Request &req);
 
 	static DissectedURL parseUrl(const std::string &url);
 
 private:
+	enum ExchangeResult
+	{
+		EXCHANGE_NO_RESPONSE,
+		EXCHANGE_CLOSE,
+		EXCHANGE_KEEP_ALIVE,
+	};
+
 	ConnectionFactory factory;
+	ConnectionPool *pool;
+
+	ExchangeResult exchange(Connection *conn, const DissectedURL &info, const HTTPSClient::Request &req, HTTPSClient::Reply &reply, Connection::clock::time_point start);
 };
@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "HTTPResponseParser.h"
+
+static const char *whitespace = " \t";
+
+static std::string trim(const std::string &str)
+{
+	size_t start = str.find_first_not_of(whitespace);
+	if (start == std::string::npos)
+		return std::string();
+
+	size_t end = str.find_last_not_of(whitespace);
+	return str.substr(start, end - start + 1);
+}
+
+static std::string toLower(std::string str)
+{
+	std::transform(str.begin(), str.end(), str.begin(), [](char c) { return (char) std::tolower((unsigned char) c); });
+	return str;
+}
+
+// Whether a comma separated list like Connection or Transfer-Encoding has the token
+static bool hasToken(const std::string &value, const std::string &token)
+{
+	std::string lower = toLower(value);
+	size_t start = 0;
+
+	while (start <= lower.size())
+	{
+		size_t end = lower.find(',', start);
+		if (end == std::string::npos)
+			end = lower.size();
+
+		if (trim(lower.substr(start, end - start)) == token)
+			return true;
+
+		start = end + 1;
+	}
+
+	return false;
+}
+
+static bool parseDecimal(const std::string &str, uint64_t &value)
+{
+	if (str.empty() || str.size() > 19)
+		return false;
+
+	value = 0;
+	for (char c : str)
+	{
+		if (c < '0' || c > '9')
+			return false;
+		value = value * 10 + (uint64_t) (c - '0');
+	}
+
+	return true;
+}
+
+HTTPResponseParser::HTTPResponseParser(bool headRequest, BodyHandler bodyHandler)
+	: headRequest(headRequest)
+	, bodyHandler(bodyHandler)
+	, state(STATE_STATUS_LINE)
+	, headerSize(0)
+	, remaining(0)
+	, bodyAborted(false)
+	, persistent(false)
+	, status(0)
+	, http10(false)
+{
+}
+
+bool HTTPResponseParser::headersComplete() const
+{
+	return state != STATE_STATUS_LINE && state != STATE_HEADERS && state != STATE_ERROR;
+}
+
+size_t HTTPResponseParser::feed(const char *data, size_t size)
+{
+	size_t i = 0;
+
+	while (i < size && state != STATE_DONE && state != STATE_ERROR)
+	{
+		switch (state)
+		{
+		case STATE_BODY:
+		case STATE_CHUNK_DATA:
+		{
+			size_t count = (size_t) std::min<uint64_t>(remaining, size - i);
+			if (!deliver(data + i, count))
+				return i;
+
+			remaining -= count;
+			i += count;
+
+			if (remaining == 0)
+				state = state == STATE_BODY ? STATE_DONE : STATE_CHUNK_DATA_END;
+			break;
+		}
+		case STATE_BODY_UNTIL_CLOSE:
+			if (!deliver(data + i, size - i))
+				return i;
+			i = size;
+			break;
+		default:
+		{
+			// Everything else is line based
+			const char *end = static_cast<const char *>(memchr(data + i, '\n', size - i));
+			size_t count = end ? (size_t) (end - (data + i)) : size - i;
+
+			headerSize += count + (end ? 1 : 0);
+			if (headerSize > maxHeaderSize)
+			{
+				state = STATE_ERROR;
+				return i;
+			}
+
+			line.append(data + i, count);
+			i += count;
+
+			if (!end)
+				break;
+
+			i++;
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+
+			bool wasHeaders = state == STATE_HEADERS;
+			parseLine();
+			line.clear();
+
+			// Give the caller a chance to look at the headers before the body
+			if (wasHeaders && headersComplete())
+				return i;
+			break;
+		}
+		}
+	}
+
+	return i;
+}
+
+void HTTPResponseParser::finish()
+{
+	if (state == STATE_BODY_UNTIL_CLOSE)
+		state = STATE_DONE;
+	else if (state != STATE_DONE)
+		state = STATE_ERROR;
+}
+
+void HTTPResponseParser::parseLine()
+{
+	switch (state)
+	{
+	case STATE_STATUS_LINE:
+		parseStatusLine();
+		break;
+	case STATE_HEADERS:
+		if (line.empty())
+			beginBody();
+		else
+			parseHeaderLine();
+		break;
+	case STATE_CHUNK_SIZE:
+	{
+		// Chunk extensions after a ';' are ignored
+		std::string size = trim(line.substr(0, line.find(';')));
+		char *end = nullptr;
+		remaining = std::strtoull(size.c_str(), &end, 16);
+
+		if (size.empty() || size.size() > 16 || *end != '\0')
+			state = STATE_ERROR;
+		else
+			state = remaining > 0 ? STATE_CHUNK_DATA : STATE_TRAILERS;
+
+		headerSize = 0;
+		break;
+	}
+	case STATE_CHUNK_DATA_END:
+		state = line.empty() ? STATE_CHUNK_SIZE : STATE_ERROR;
+		break;
+	case STATE_TRAILERS:
+		// Trailers are skipped, the empty line ends the message
+		if (line.empty())
+			state = STATE_DONE;
+		break;
+	default:
+		break;
+	}
+}
+
+void HTTPResponseParser::parseStatusLine()
+{
+	// Some servers send empty lines between responses
+	if (line.empty())
+		return;
+
+	if (line.compare(0, 9, "HTTP/1.1 ") == 0)
+		http10 = false;
+	else if (line.compare(0, 9, "HTTP/1.0 ") == 0)
+		http10 = true;
+	else
+	{
+		state = STATE_ERROR;
+		return;
+	}
+
+	if (line.size() < 12 || !isdigit((unsigned char) line[9]) || !isdigit((unsigned char) line[10]) || !isdigit((unsigned char) line[11])
+		|| (line.size() > 12 && line[12] != ' '))
+	{
+		state = STATE_ERROR;
+		return;
+	}
+
+	status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+	headers.clear();
+	lastHeader.clear();
+	state = STATE_HEADERS;
+}
+
+void HTTPResponseParser::parseHeaderLine()
+{
+	// Obsolete line folding continues the previous header
+	if (line[0] == ' ' || line[0] == '\t')
+	{
+		if (lastHeader.empty())
+		{
+			state = STATE_ERROR;
+			return;
+		}
+
+		headers.append(lastHeader, trim(line), " ");
+		return;
+	}
+
+	size_t sep = line.find(':');
+	if (sep == std::string::npos || sep == 0 || line.find_first_of(whitespace) < sep)
+	{
+		state = STATE_ERROR;
+		return;
+	}
+
+	std::string name = line.substr(0, sep);
+	std::string value = trim(line.substr(sep + 1));
+
+	headers.add(name, value);
+
+	lastHeader = name;
+}
+
+void HTTPResponseParser::beginBody()
+{
+	// Interim responses are followed by the real one, 101 hands the connection over
+	if (status >= 100 && status < 200 && status != 101)
+	{
+		state = STATE_STATUS_LINE;
+		headerSize = 0;
+		return;
+	}
+
+	auto connection = headers.find("Connection");
+	if (http10)
+		persistent = connection != headers.end() && hasToken(connection->value.str(), "keep-alive");
+	else
+		persistent = connection == headers.end() || !hasToken(connection->value.str(), "close");
+
+	// Responses to HEAD and these status codes never have a body
+	if (headRequest || status == 204 || status == 304 || status == 101)
+	{
+		persistent = persistent && status != 101;
+		state = STATE_DONE;
+		return;
+	}
+
+	auto transferEncoding = headers.find("Transfer-Encoding");
+	auto contentLength = headers.find("Content-Length");
+
+	if (transferEncoding != headers.end())
+	{
+		std::string codings = toLower(transferEncoding->value.str());
+		size_t last = codings.rfind(',');
+		std::string final = trim(last == std::string::npos ? codings : codings.substr(last + 1));
+
+		// Content-Length next to Transfer-Encoding is a smuggling attempt or a broken server
+		if (contentLength != headers.end())
+			persistent = false;
+
+		if (final == "chunked")
+			state = STATE_CHUNK_SIZE;
+		else
+		{
+			persistent = false;
+			state = STATE_BODY_UNTIL_CLOSE;
+		}
+	}
+	else if (contentLength != headers.end())
+	{
+		// A repeated Content-Length was combined into a list, its values must agree
+		std::string value;
+		const std::string list = contentLength->value.str();
+		for (size_t start = 0; start <= list.size(); )
+		{
+			size_t end = std::min(list.find(',', start), list.size());
+			std::string item = trim(list.substr(start, end - start));
+
+			if (value.empty())
+				value = item;
+			else if (item != value)
+			{
+				state = STATE_ERROR;
+				return;
+			}
+
+			start = end + 1;
+		}
+
+		if (!parseDecimal(value, remaining))
+		{
+			state = STATE_ERROR;
+			return;
+		}
+
+		state = remaining > 0 ? STATE_BODY : STATE_DONE;
+	}
+	else
+	{
+		// No framing, the body ends when the server closes the connection
+		persistent = false;
+		state = STATE_BODY_UNTIL_CLOSE;
+	}
+
+	headerSize = 0;
+}
+
+bool HTTPResponseParser::deliver(const char *data, size_t size)
+{
+	if (size == 0 || !bodyHandler || bodyHandler(data, size))
+		return true;
+
+	bodyAborted = true;
+	state = STATE_ERROR;
+	return false;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "HTTPSClient.h"
+
+// Parses an HTTP/1.x response as it arrives and works out where it ends, from
+// Content-Length, chunked encoding or the status, so that the connection can
+// be used again afterwards.
+class HTTPResponseParser
+{
+public:
+	// Receives the decoded body, returning false stops parsing
+	typedef std::function<bool(const char *data, size_t size)> BodyHandler;
+
+	HTTPResponseParser(bool headRequest, BodyHandler bodyHandler);
+
+	// Consumes data up to the end of the headers or the end of the message,
+	// returns how much was used. Feed the rest again after checking
+	// headersComplete(), anything left once done() is not part of this response.
+	size_t feed(const char *data, size_t size);
+	// The peer closed the connection
+	void finish();
+
+	bool headersComplete() const;
+	bool done() const { return state == STATE_DONE; }
+	bool failed() const { return state == STATE_ERROR; }
+	// Whether the body handler stopped parsing
+	bool aborted() const { return bodyAborted; }
+
+	int getStatus() const { return status; }
+	HTTPSClient::header_map &getHeaders() { return headers; }
+	// Whether the connection may carry another request once done
+	bool keepAlive() const { return persistent; }
+
+private:
+	enum State
+	{
+		STATE_STATUS_LINE,
+		STATE_HEADERS,
+		STATE_BODY,
+		STATE_BODY_UNTIL_CLOSE,
+		STATE_CHUNK_SIZE,
+		STATE_CHUNK_DATA,
+		STATE_CHUNK_DATA_END,
+		STATE_TRAILERS,
+		STATE_DONE,
+		STATE_ERROR,
+	};
+
+	// Status line and header block are limited, so a broken peer can't make us buffer forever
+	static const size_t maxHeaderSize = 65536;
+
+	void parseLine();
+	void parseStatusLine();
+	void parseHeaderLine();
+	void beginBody();
+	bool deliver(const char *data, size_t size);
+
+	bool headRequest;
+	BodyHandler bodyHandler;
+
+	State state;
+	std::string line;
+	size_t headerSize;
+	uint64_t remaining;
+	bool bodyAborted;
+	bool persistent;
+
+	int status;
+	bool http10;
+	HTTPSClient::header_map headers;
+	std::string lastHeader;
+};
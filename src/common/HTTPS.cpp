@@ -1,8 +1,17 @@
 #include "HTTPS.h"
 #include "config.h"
 #include "ConnectionClient.h"
+#include "FileWriter.h"
 #include "LibraryLoader.h"
+#include "Resolver.h"
+#include "Stats.h"
+#include "WorkerPool.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
 #include <stdexcept>
 
 #ifdef HTTPS_BACKEND_CURL
@@ -43,41 +52,352 @@
 	static WinINetClient wininetclient;
 #endif
 
-static HTTPSClient *clients[] = {
+struct Backend
+{
+	Backend(const char *name, HTTPSClient *client)
+		: name(name)
+		, client(client)
+		, available(false)
+	{
+	}
+
+	const char *name;
+	HTTPSClient *client;
+
+	// valid() may load libraries or read the environment, so each backend is
+	// only asked once, when a request first considers it
+	std::once_flag probed;
+	bool available;
+};
+
+static Backend backends[] = {
 #ifdef HTTPS_BACKEND_CURL
-	&curlclient,
+	{"curl", &curlclient},
 #endif
 #ifdef HTTPS_BACKEND_OPENSSL
-	&opensslclient,
+	{"openssl", &opensslclient},
 #endif
 	// WinINet must be above SChannel
 #ifdef HTTPS_BACKEND_WININET
-	&wininetclient,
+	{"wininet", &wininetclient},
 #endif
 #ifdef HTTPS_BACKEND_SCHANNEL
-	&schannelclient,
+	{"schannel", &schannelclient},
 #endif
 #ifdef HTTPS_BACKEND_NSURL
-	&nsurlclient,
+	{"nsurl", &nsurlclient},
 #endif
 #ifdef HTTPS_BACKEND_ANDROID
-	&androidclient,
+	{"android", &androidclient},
 #endif
-	nullptr,
+	{nullptr, nullptr},
 };
 
 // Call into the library loader to make sure it is linked in
 static LibraryLoader::handle* dummyProcessHandle = LibraryLoader::GetCurrentProcessHandle();
 
+static bool isAvailable(Backend &backend)
+{
+	std::call_once(backend.probed, [&backend]() {
+		backend.available = backend.client->valid();
+	});
+
+	return backend.available;
+}
+
+// The most preferred backend that works, looked for once. Those after it are
+// never asked, so their libraries stay unloaded unless something picks them.
+static Backend *findDefault()
+{
+	static std::once_flag found;
+	static Backend *backend = nullptr;
+
+	std::call_once(found, []() {
+		for (size_t i = 0; backends[i].client; ++i)
+		{
+			if (isAvailable(backends[i]))
+			{
+				backend = &backends[i];
+				break;
+			}
+		}
+	});
+
+	return backend;
+}
+
+static Backend *findBackend(const std::string &name)
+{
+	for (size_t i = 0; backends[i].client; ++i)
+	{
+		if (name == backends[i].name)
+			return isAvailable(backends[i]) ? &backends[i] : nullptr;
+	}
+
+	return nullptr;
+}
+
+// Set by setBackend, the default otherwise
+static std::atomic<Backend *> pinned(nullptr);
+
+static Backend &selectBackend(const std::string &name)
+{
+	Backend *backend = nullptr;
+	if (!name.empty())
+	{
+		backend = findBackend(name);
+		if (!backend)
+			throw std::runtime_error("Backend not available: " + name);
+		return *backend;
+	}
+
+	backend = pinned.load();
+	if (!backend)
+		backend = findDefault();
+	if (!backend)
+		throw std::runtime_error("No applicable HTTPS implementation found");
+
+	return *backend;
+}
+
+static HTTPSClient &selectClient(const HTTPSClient::Request &req)
+{
+	return *selectBackend(req.backend).client;
+}
+
+// Requests the backends don't run on their own event loop pass through here to be counted
+static HTTPSClient::Reply countedRequest(HTTPSClient &client, const HTTPSClient::Request &req)
+{
+	auto start = std::chrono::steady_clock::now();
+	HTTPSClient::Reply reply;
+
+	try
+	{
+		reply = client.request(req);
+	}
+	catch (const HTTPSClient::TimeoutError &)
+	{
+		Stats::add(Stats::ERRORS_TIMEOUT);
+		throw;
+	}
+	catch (const std::exception &)
+	{
+		Stats::add(Stats::ERRORS_OTHER);
+		throw;
+	}
+
+	// Backends that leave the connection to the system don't time their requests
+	double seconds = reply.timings.total;
+	if (seconds <= 0.0)
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	Stats::recordReply(req.url, reply, seconds);
+	return reply;
+}
+
 HTTPSClient::Reply request(const HTTPSClient::Request &req)
 {
-	for (size_t i = 0; clients[i]; ++i)
+	return countedRequest(selectClient(req), req);
+}
+
+HTTPSClient::Reply download(HTTPSClient::Request req, const std::string &path)
+{
+	FileWriter file(path);
+	uint64_t written = 0;
+	bool aborted = false;
+
+	auto onHeaders = std::move(req.onHeaders);
+	req.onHeaders = [&onHeaders, &aborted](int responseCode, const HTTPSClient::header_map &headers) {
+		aborted = onHeaders && !onHeaders(responseCode, headers);
+		return !aborted;
+	};
+	req.sink = [&file, &written](const char *data, size_t size) {
+		written += size;
+		return file.write(data, size);
+	};
+
+	HTTPSClient::Reply reply = request(req);
+
+	if (file.failed())
+		throw std::runtime_error("Could not write " + path);
+
+	// Error pages and aborted or cut off transfers leave the old file alone
+	if (aborted || reply.responseCode < 200 || reply.responseCode >= 300)
+		return reply;
+
+	if (!reply.error.empty())
+		throw std::runtime_error(reply.error);
+
+	// A decoded body no longer matches the Content-Length, which counts it encoded
+	auto contentLength = reply.headers.find("Content-Length");
+	bool decoded = req.decompress && reply.headers.contains("Content-Encoding");
+	if (contentLength != reply.headers.end() && req.method != "HEAD" && !decoded && std::strtoull(contentLength->value.str().c_str(), nullptr, 10) != written)
+		throw std::runtime_error("Connection closed before the download finished");
+
+	file.commit();
+	return reply;
+}
+
+static WorkerPool &getWorkerPool()
+{
+	// Threads are started on first use, most programs never need them
+	static WorkerPool pool(4, 256);
+	return pool;
+}
+
+std::shared_ptr<AsyncRequest> requestAsync(const HTTPSClient::Request &req)
+{
+	HTTPSClient &client = selectClient(req);
+	std::shared_ptr<AsyncRequest> async = std::make_shared<AsyncRequest>(req);
+
+	// Backends with their own event loop don't need a thread per request
+	if (client.submit(async))
+		return async;
+
+	bool queued = getWorkerPool().submit(async, [&client, async]() {
+		try
+		{
+			async->complete(countedRequest(client, async->getRequest()));
+		}
+		catch (const std::exception &e)
+		{
+			async->fail(e.what());
+		}
+	});
+
+	if (!queued)
+		throw std::runtime_error("Too many asynchronous requests in flight");
+
+	return async;
+}
+
+std::vector<std::shared_ptr<AsyncRequest>> requestMany(const std::vector<HTTPSClient::Request> &reqs, size_t concurrency)
+{
+	// Shared with the runners, one may only start after the call returned
+	struct Batch
 	{
-		HTTPSClient &client = *clients[i];
+		std::vector<std::shared_ptr<AsyncRequest>> results;
+		std::atomic<size_t> next;
+	};
+
+	std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+	batch->next = 0;
+	batch->results.reserve(reqs.size());
+	for (const auto &req : reqs)
+		batch->results.push_back(std::make_shared<AsyncRequest>(req));
+
+	// Each runner takes the next request once its last one is done. Backends
+	// with their own event loop get the requests handed over, so those to the
+	// same server can share a connection, the runner just waits for them.
+	auto run = [batch]() {
+		auto &results = batch->results;
+		for (size_t i = batch->next++; i < results.size(); i = batch->next++)
+		{
+			AsyncRequest &async = *results[i];
 
-		if (client.valid())
-			return client.request(req);
+			try
+			{
+				HTTPSClient &client = selectClient(async.getRequest());
+				if (client.submit(results[i]))
+					async.wait();
+				else
+					async.complete(countedRequest(client, async.getRequest()));
+			}
+			catch (const std::exception &e)
+			{
+				async.fail(e.what());
+			}
+		}
+	};
+
+	// The calling thread is one of the runners, the others come from the
+	// worker pool. Fewer runners, when it is busy, only make it slower.
+	concurrency = std::max<size_t>(std::min(concurrency, batch->results.size()), 1);
+	for (size_t i = 1; i < concurrency; ++i)
+	{
+		if (!getWorkerPool().submit(nullptr, run))
+			break;
 	}
 
-	throw std::runtime_error("No applicable HTTPS implementation found");
+	run();
+
+	// Whatever the other runners took is waited for here
+	for (auto &async : batch->results)
+		async->wait();
+
+	return batch->results;
+}
+
+void setCABundle(const std::string &pem)
+{
+	// Each backend parses the bundle once it is loaded and needs it, this
+	// only catches what isn't PEM at all before any of them takes it
+	if (!pem.empty() && pem.find("-----BEGIN CERTIFICATE-----") == std::string::npos)
+		throw std::runtime_error("Could not load CA bundle");
+
+	// Curl goes first, it refuses without changing anything, after which
+	// nothing can fail anymore, so the backends never disagree
+#ifdef HTTPS_BACKEND_CURL
+	if (!CurlClient::setCABundle(pem))
+		throw std::runtime_error("This version of libcurl does not support CA bundles in memory");
+#endif
+#ifdef HTTPS_BACKEND_OPENSSL
+	OpenSSLConnection::setCABundle(pem);
+#endif
+	(void) pem;
+}
+
+void resolve(const std::string &hostname)
+{
+	Resolver::getInstance().prefetch(hostname);
+}
+
+void setDNSCacheTTL(double ttl, double negativeTTL)
+{
+	auto toDuration = [](double seconds) {
+		return std::chrono::duration_cast<Resolver::clock::duration>(std::chrono::duration<double>(std::max(seconds, 0.0)));
+	};
+
+	Resolver::getInstance().setTTL(toDuration(ttl), toDuration(negativeTTL));
+}
+
+Stats::Snapshot getStats()
+{
+	return Stats::read();
+}
+
+void resetStats()
+{
+	Stats::reset();
+}
+
+std::string init()
+{
+	return selectBackend("").name;
+}
+
+std::vector<std::string> getBackends()
+{
+	std::vector<std::string> names;
+	for (size_t i = 0; backends[i].client; ++i)
+	{
+		if (isAvailable(backends[i]))
+			names.push_back(backends[i].name);
+	}
+
+	return names;
+}
+
+std::string getBackend()
+{
+	Backend *backend = pinned.load();
+	if (!backend)
+		backend = findDefault();
+
+	return backend ? backend->name : "";
+}
+
+void setBackend(const std::string &name)
+{
+	pinned = name.empty() ? nullptr : &selectBackend(name);
 }
@@ -1,5 +1,47 @@
 #pragma once
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "HTTPSClient.h"
+#include "AsyncRequest.h"
+#include "Stats.h"
+
+// Backends are loaded on the first request. This loads the one requests will
+// use right away instead, and returns its name. Throws if there is none.
+std::string init();
 
 HTTPSClient::Reply request(const HTTPSClient::Request &req);
+
+// Writes the body of a successful (2xx) response to path, replacing the file
+// only once the whole body is on disk. The returned reply has no body.
+HTTPSClient::Reply download(HTTPSClient::Request req, const std::string &path);
+
+// Runs the request on a worker thread, throws if too many requests are queued
+std::shared_ptr<AsyncRequest> requestAsync(const HTTPSClient::Request &req);
+
+// Runs all requests, at most concurrency of them at a time, and returns once
+// every one of them is done. The results are in the same order as the requests.
+std::vector<std::shared_ptr<AsyncRequest>> requestMany(const std::vector<HTTPSClient::Request> &reqs, size_t concurrency);
+
+// Replaces the system CA store with a PEM bundle on the backends that allow it
+void setCABundle(const std::string &pem);
+
+// Starts resolving the host in the background, so later requests find it cached
+void resolve(const std::string &hostname);
+
+// How long, in seconds, lookups and failed lookups are cached. 0 turns caching off.
+void setDNSCacheTTL(double ttl, double negativeTTL);
+
+// Counters and latencies of every request since the start, or the last reset
+Stats::Snapshot getStats();
+void resetStats();
+
+// The backends that work on this system, most preferred first. Loads all of them.
+std::vector<std::string> getBackends();
+// What requests run on unless they name a backend, empty if there is none
+std::string getBackend();
+// Runs later requests on the named backend, or the most preferred one again
+// if the name is empty. Throws if the backend isn't available.
+void setBackend(const std::string &name);
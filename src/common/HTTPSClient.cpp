@@ -1,37 +1,82 @@
 #include <algorithm>
-#include <cctype>
+#include <cstdlib>
 
 #include "HTTPSClient.h"
+#include "FileReader.h"
 
-// This may not be the order you expect, as shorter strings always compare less,
-// but it's sufficient for our map
-bool HTTPSClient::ci_string_less::operator()(const std::string &lhs, const std::string &rhs) const
+HTTPSClient::Request::Request(const std::string &url)
+: url(url)
+, method("GET")
+, timeout(0)
+, connectTimeout(0)
+, idleTimeout(0)
+, decompress(false)
+{
+}
+
+bool HTTPSClient::readBody(const Request &req, std::string &body)
 {
-	const size_t lhs_size = lhs.size();
-	const size_t rhs_size = rhs.size();
-	const size_t steps = std::min(lhs_size, rhs_size);
+	if (!req.postfile.empty())
+	{
+		FileReader file(req.postfile);
+		body.resize((size_t) file.getSize());
+
+		size_t total = 0;
+		while (total < body.size())
+		{
+			size_t read = file.read(&body[total], body.size() - total);
+			if (read == 0)
+				break;
+			total += read;
+		}
 
-	if (lhs_size < rhs_size)
+		body.resize(total);
 		return true;
-	else if (lhs_size > rhs_size)
-		return false;
+	}
 
-	for (size_t i = 0; i < steps; ++i)
+	if (req.source)
 	{
-		char l = std::tolower(lhs[i]);
-		char r = std::tolower(rhs[i]);
-		if (l < r)
-			return true;
-		else if (l > r)
-			return false;
+		body.clear();
+		for (std::string chunk; ; chunk.clear())
+		{
+			if (!req.source(chunk))
+				return false;
+			if (chunk.empty())
+				return true;
+			body += chunk;
+		}
 	}
 
-	return false;
+	body = req.postdata.str();
+	return true;
 }
 
-HTTPSClient::Request::Request(const std::string &url)
-: url(url)
-, method("GET")
+void HTTPSClient::reserveBody(const Request &req, Reply &reply)
 {
+	if (req.sink)
+		return;
+
+	auto length = reply.headers.find("Content-Length");
+	if (length == reply.headers.end())
+		return;
+
+	unsigned long long size = strtoull(length->value.str().c_str(), nullptr, 10);
+	reply.body.reserve((size_t) std::min(size, (unsigned long long) maxReservedBody));
 }
 
+bool HTTPSClient::deliver(const Request &req, Reply &reply)
+{
+	reply.rawBodySize = reply.bodySize = reply.body.size();
+
+	if (req.onHeaders && !req.onHeaders(reply.responseCode, reply.headers))
+		return false;
+
+	if (req.sink && !reply.body.empty())
+	{
+		std::string body = std::move(reply.body);
+		reply.body.clear();
+		return req.sink(body.data(), body.size());
+	}
+
+	return true;
+}
@@ -1,17 +1,21 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <string>
-#include <map>
+#include <memory>
+#include <stdexcept>
+
+#include "HeaderMap.h"
+#include "StringRef.h"
+
+class AsyncRequest;
 
 class HTTPSClient
 {
 public:
-	struct ci_string_less
-	{
-		bool operator()(const std::string &lhs, const std::string &rhs) const;
-	};
-	using header_map = std::map<std::string, std::string, ci_string_less>;
+	using header_map = HeaderMap;
 
 	struct Request
 	{
@@ -19,18 +23,99 @@ public:
 
 		header_map headers;
 		std::string url;
-		std::string postdata;
+		// Borrowed, the caller keeps the memory around until the request is done
+		StringRef postdata;
 		std::string method;
+
+		// Optional, sends the file at this path as the body instead of postdata
+		std::string postfile;
+		// Optional, produces the body piece by piece instead of postdata, it is
+		// sent chunked. An empty chunk ends the body, returning false aborts.
+		std::function<bool(std::string &chunk)> source;
+
+		bool hasBody() const { return !postdata.empty() || !postfile.empty() || source; }
+
+		// Optional limits, zero means none. timeout covers the whole request,
+		// connectTimeout getting a connection, and idleTimeout any single wait
+		// for the server once connected.
+		std::chrono::milliseconds timeout;
+		std::chrono::milliseconds connectTimeout;
+		std::chrono::milliseconds idleTimeout;
+
+		// Optional, the name of the backend to run on instead of the selected one
+		std::string backend;
+
+		// Asks for a compressed response and decodes it, the body arrives as
+		// the server would have sent it without Content-Encoding
+		bool decompress;
+
+		// Optional, called with the status code and headers before any of the body
+		std::function<bool(int responseCode, const header_map &headers)> onHeaders;
+		// Optional, receives the body as it arrives instead of Reply::body.
+		// Returning false from either callback aborts the request.
+		std::function<bool(const char *data, size_t size)> sink;
+	};
+
+	// Seconds from the start of a request until each phase ended, like curl's
+	// *_TIME_T values. Phases that didn't happen, such as connecting on a
+	// reused connection or a handshake over plain HTTP, are 0. Backends that
+	// leave the connection to the system don't fill them in.
+	struct Timings
+	{
+		double nameLookup = 0.0;
+		double connect = 0.0;
+		double tlsHandshake = 0.0;
+		double firstByte = 0.0;
+		double total = 0.0;
+		// Headers and body as sent and received, without the TLS framing
+		uint64_t bytesSent = 0;
+		uint64_t bytesReceived = 0;
+		bool reused = false;
 	};
 
 	struct Reply
 	{
 		header_map headers;
 		std::string body;
-		int responseCode;
+		int responseCode = 0;
+		// The size of the body as it was transferred, and after decoding it.
+		// Backends that leave the decoding to the system only know the latter.
+		uint64_t rawBodySize = 0;
+		uint64_t bodySize = 0;
+		Timings timings;
+		// Set when the response started but the transfer failed before it was
+		// complete, or the rest of it could not be parsed. The body is cut off.
+		std::string error;
+	};
+
+	// Thrown when a request runs out of one of its timeouts
+	class TimeoutError : public std::runtime_error
+	{
+	public:
+		TimeoutError() : std::runtime_error("timeout") {}
 	};
 
 	virtual ~HTTPSClient() {}
 	virtual bool valid() const = 0;
 	virtual Reply request(const Request &req) = 0;
+
+	// Backends that can run requests on threads of their own take them here,
+	// others return false and the request goes to the shared worker threads
+	virtual bool submit(const std::shared_ptr<AsyncRequest> &) { return false; }
+
+	// Makes room for the body the headers announce, so collecting it doesn't
+	// move it around as it grows. Only for bodies that arrive as sent.
+	static void reserveBody(const Request &req, Reply &reply);
+
+	// Announced sizes above this are grown into, in case they are lies
+	static const size_t maxReservedBody = 64 * 1024 * 1024;
+
+protected:
+	// For backends that can't stream request bodies, reads postfile or source
+	// into one string. Returns false if the source aborted.
+	static bool readBody(const Request &req, std::string &body);
+
+	// For backends that only see the body once it is complete, hands the
+	// reply to the request's callbacks. Returns false if they aborted.
+	static bool deliver(const Request &req, Reply &reply);
 };
@@ -0,0 +1,309 @@
+#include "HeaderMap.h"
+
+#include <cctype>
+
+namespace
+{
+	struct KnownName
+	{
+		const char *name;
+		size_t size;
+	};
+
+	template<size_t N>
+	constexpr KnownName known(const char (&name)[N])
+	{
+		return {name, N - 1};
+	}
+
+	// Names that show up in nearly every request or response
+	constexpr KnownName knownNames[] = {
+		known("Accept"),
+		known("Accept-Encoding"),
+		known("Accept-Language"),
+		known("Accept-Ranges"),
+		known("Age"),
+		known("Authorization"),
+		known("Cache-Control"),
+		known("Connection"),
+		known("Content-Disposition"),
+		known("Content-Encoding"),
+		known("Content-Length"),
+		known("Content-Range"),
+		known("Content-Type"),
+		known("Cookie"),
+		known("Date"),
+		known("ETag"),
+		known("Expires"),
+		known("Host"),
+		known("If-Modified-Since"),
+		known("If-None-Match"),
+		known("Keep-Alive"),
+		known("Last-Modified"),
+		known("Location"),
+		known("Range"),
+		known("Referer"),
+		known("Server"),
+		known("Set-Cookie"),
+		known("Transfer-Encoding"),
+		known("User-Agent"),
+		known("Vary"),
+	};
+
+	constexpr size_t knownCount = sizeof(knownNames) / sizeof(knownNames[0]);
+
+	constexpr bool sameName(const char *a, const char *b)
+	{
+		return *a == *b && (*a == '\0' || sameName(a + 1, b + 1));
+	}
+
+	constexpr int knownId(const char *name, size_t i = 0)
+	{
+		return i == knownCount ? -1 : (sameName(knownNames[i].name, name) ? (int) i : knownId(name, i + 1));
+	}
+
+	constexpr int setCookie = knownId("Set-Cookie");
+	static_assert(setCookie >= 0, "Set-Cookie must be a known name");
+
+	// Known names are found by their length and first and last letter, which
+	// these factors spread over the slots without any two sharing one
+	constexpr size_t slotCount = 64;
+
+	constexpr size_t slotOf(size_t size, char first, char last)
+	{
+		// Only lowers letters, but the other characters only have to hash the same way each time
+		return (size * 14 + ((unsigned char) first | 0x20) * 34 + ((unsigned char) last | 0x20)) & (slotCount - 1);
+	}
+
+	constexpr size_t slotOf(const KnownName &known)
+	{
+		return slotOf(known.size, known.name[0], known.name[known.size - 1]);
+	}
+
+	struct Slots
+	{
+		signed char ids[slotCount];
+	};
+
+	constexpr Slots makeSlots()
+	{
+		Slots slots = {};
+		for (size_t i = 0; i < slotCount; ++i)
+			slots.ids[i] = -1;
+		for (size_t i = 0; i < knownCount; ++i)
+			slots.ids[slotOf(knownNames[i])] = (signed char) i;
+		return slots;
+	}
+
+	constexpr bool slotsAreUnique()
+	{
+		bool used[slotCount] = {};
+		for (size_t i = 0; i < knownCount; ++i)
+		{
+			if (used[slotOf(knownNames[i])])
+				return false;
+			used[slotOf(knownNames[i])] = true;
+		}
+
+		return true;
+	}
+
+	static_assert(slotsAreUnique(), "Two known names share a slot, pick other factors in slotOf");
+
+	constexpr Slots slots = makeSlots();
+
+	bool equalsIgnoreCase(const char *a, const char *b, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (std::tolower((unsigned char) a[i]) != std::tolower((unsigned char) b[i]))
+				return false;
+		}
+
+		return true;
+	}
+
+	bool equalsIgnoreCase(StringRef a, StringRef b)
+	{
+		return a.size == b.size && equalsIgnoreCase(a.data, b.data, a.size);
+	}
+}
+
+HeaderMap::const_iterator::const_iterator(const HeaderMap *map, size_t index)
+	: map(map)
+	, index(index)
+{
+	if (index < map->entries.size())
+		header = map->toHeader(index);
+}
+
+HeaderMap::const_iterator &HeaderMap::const_iterator::operator++()
+{
+	if (++index < map->entries.size())
+		header = map->toHeader(index);
+	return *this;
+}
+
+int HeaderMap::intern(StringRef name)
+{
+	if (name.empty())
+		return -1;
+
+	int id = slots.ids[slotOf(name.size, name.data[0], name.data[name.size - 1])];
+	if (id >= 0 && knownNames[id].size == name.size && equalsIgnoreCase(knownNames[id].name, name.data, name.size))
+		return id;
+
+	return -1;
+}
+
+const HeaderMap::Entry *HeaderMap::lookup(StringRef name, int id) const
+{
+	for (const Entry &entry : entries)
+	{
+		if (id >= 0 ? entry.id == id : (entry.id < 0 && equalsIgnoreCase(StringRef(&buffer[entry.nameOffset], entry.nameSize), name)))
+			return &entry;
+	}
+
+	return nullptr;
+}
+
+HeaderMap::Entry *HeaderMap::lookup(StringRef name, int id)
+{
+	return const_cast<Entry *>(static_cast<const HeaderMap *>(this)->lookup(name, id));
+}
+
+HeaderMap::const_iterator HeaderMap::find(StringRef name) const
+{
+	const Entry *entry = lookup(name, intern(name));
+	return const_iterator(this, entry ? (size_t) (entry - entries.data()) : entries.size());
+}
+
+void HeaderMap::clear()
+{
+	buffer.clear();
+	entries.clear();
+	unused = 0;
+}
+
+bool HeaderMap::owns(StringRef str) const
+{
+	return str.data >= buffer.data() && str.data < buffer.data() + buffer.size();
+}
+
+uint32_t HeaderMap::store(StringRef str)
+{
+	uint32_t offset = (uint32_t) buffer.size();
+	buffer.append(str.data, str.size);
+	return offset;
+}
+
+void HeaderMap::release(uint32_t offset, uint32_t size)
+{
+	if (offset + size == buffer.size())
+		buffer.resize(offset);
+	else
+		unused += size;
+}
+
+void HeaderMap::compactIfWasteful()
+{
+	if (unused <= buffer.size() / 2)
+		return;
+
+	std::string compacted;
+	compacted.reserve(buffer.size() - unused);
+
+	for (Entry &entry : entries)
+	{
+		uint32_t nameOffset = (uint32_t) compacted.size();
+		compacted.append(buffer, entry.nameOffset, entry.nameSize);
+		uint32_t valueOffset = (uint32_t) compacted.size();
+		compacted.append(buffer, entry.valueOffset, entry.valueSize);
+
+		entry.nameOffset = nameOffset;
+		entry.valueOffset = valueOffset;
+	}
+
+	buffer.swap(compacted);
+	unused = 0;
+}
+
+HeaderMap::Header HeaderMap::toHeader(size_t index) const
+{
+	const Entry &entry = entries[index];
+	return {
+		StringRef(buffer.data() + entry.nameOffset, entry.nameSize),
+		StringRef(buffer.data() + entry.valueOffset, entry.valueSize),
+	};
+}
+
+void HeaderMap::set(StringRef name, StringRef value)
+{
+	// Storing may move the buffer, anything pointing into it has to be copied first
+	if (owns(name) || owns(value))
+		return set(name.str(), value.str());
+
+	int id = intern(name);
+	Entry *entry = lookup(name, id);
+
+	if (!entry)
+	{
+		uint32_t nameOffset = store(name);
+		entries.push_back({nameOffset, (uint32_t) name.size, store(value), (uint32_t) value.size, id});
+		return;
+	}
+
+	if (value.size <= entry->valueSize)
+	{
+		// Fits where the old value was
+		buffer.replace(entry->valueOffset, value.size, value.data, value.size);
+		release(entry->valueOffset + (uint32_t) value.size, entry->valueSize - (uint32_t) value.size);
+	}
+	else
+	{
+		release(entry->valueOffset, entry->valueSize);
+		entry->valueOffset = store(value);
+	}
+
+	entry->valueSize = (uint32_t) value.size;
+	compactIfWasteful();
+}
+
+void HeaderMap::add(StringRef name, StringRef value)
+{
+	append(name, value, intern(name) == setCookie ? "\n" : ", ");
+}
+
+void HeaderMap::append(StringRef name, StringRef more, StringRef separator)
+{
+	Entry *entry = lookup(name, intern(name));
+	if (!entry)
+		return set(name, more);
+
+	if (more.empty())
+		return;
+
+	if (owns(more) || owns(separator))
+		return append(name, more.str(), separator.str());
+
+	size_t size = entry->valueSize + (entry->valueSize > 0 ? separator.size : 0) + more.size;
+
+	// A value at the end of the buffer grows where it is, any other one is
+	// moved to the end in one piece
+	if (entry->valueOffset + entry->valueSize != buffer.size())
+	{
+		buffer.reserve(buffer.size() + size);
+
+		uint32_t offset = (uint32_t) buffer.size();
+		buffer.append(buffer, entry->valueOffset, entry->valueSize);
+		unused += entry->valueSize;
+		entry->valueOffset = offset;
+	}
+
+	if (entry->valueSize > 0)
+		buffer.append(separator.data, separator.size);
+	buffer.append(more.data, more.size);
+
+	entry->valueSize = (uint32_t) size;
+	compactIfWasteful();
+}
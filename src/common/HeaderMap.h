@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "StringRef.h"
+
+// Headers in one buffer, with a small list of where each name and value is.
+// Names compare case-insensitively, the common ones are looked up in a table
+// when added, so finding them only compares their ids.
+class HeaderMap
+{
+public:
+	// Only valid until the map changes
+	struct Header
+	{
+		StringRef name;
+		StringRef value;
+	};
+
+	class const_iterator
+	{
+	public:
+		const_iterator(const HeaderMap *map, size_t index);
+
+		Header operator*() const { return header; }
+		const Header *operator->() const { return &header; }
+		const_iterator &operator++();
+		bool operator==(const const_iterator &other) const { return index == other.index; }
+		bool operator!=(const const_iterator &other) const { return index != other.index; }
+
+	private:
+		friend class HeaderMap;
+
+		const HeaderMap *map;
+		size_t index;
+		Header header;
+	};
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, entries.size()); }
+	const_iterator find(StringRef name) const;
+	bool contains(StringRef name) const { return find(name) != end(); }
+
+	bool empty() const { return entries.empty(); }
+	size_t size() const { return entries.size(); }
+	void clear();
+
+	// Replaces the header, or adds it if there is none of that name
+	void set(StringRef name, StringRef value);
+	// Adds a header as it was received. Repeated headers are combined into a
+	// comma separated list, except Set-Cookie, whose values contain commas
+	// themselves, so each cookie goes on a line of its own.
+	void add(StringRef name, StringRef value);
+	// Continues the value of a header, separated by separator unless it was empty
+	void append(StringRef name, StringRef more, StringRef separator);
+
+private:
+	struct Entry
+	{
+		uint32_t nameOffset;
+		uint32_t nameSize;
+		uint32_t valueOffset;
+		uint32_t valueSize;
+		// Index in the table of well-known names, or -1
+		int id;
+	};
+
+	static int intern(StringRef name);
+	Entry *lookup(StringRef name, int id);
+	const Entry *lookup(StringRef name, int id) const;
+	bool owns(StringRef str) const;
+	uint32_t store(StringRef str);
+	// Gives up bytes no entry points at anymore
+	void release(uint32_t offset, uint32_t size);
+	void compactIfWasteful();
+	Header toHeader(size_t index) const;
+
+	// Values that change are overwritten where they fit, or stored again at
+	// the end. The bytes left behind are counted, once they are more than
+	// half the buffer it is rewritten without them.
+	std::string buffer;
+	std::vector<Entry> entries;
+	size_t unused = 0;
+};
@@ -1,26 +1,101 @@
 #include "config.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstring>
+#include <vector>
 #ifndef HTTPS_USE_WINSOCK
 #	include <netdb.h>
 #	include <unistd.h>
 #	include <sys/types.h>
 #	include <sys/socket.h>
+#	include <sys/uio.h>
+#	include <netinet/in.h>
+#	include <netinet/tcp.h>
+#	include <fcntl.h>
+#	include <poll.h>
+#	ifdef __linux__
+#		include <sys/sendfile.h>
+#	endif
 #else
 #	include <winsock2.h>
 #	include <ws2tcpip.h>
 #endif // HTTPS_USE_WINSOCK
 
 #include "PlaintextConnection.h"
+#include "Resolver.h"
+#include "SigpipeGuard.h"
+#include "Stats.h"
 
 #ifdef HTTPS_USE_WINSOCK
 	static void close(int fd)
 	{
 		closesocket(fd);
 	}
+
+	static int poll(pollfd *fds, ULONG nfds, int timeout)
+	{
+		return WSAPoll(fds, nfds, timeout);
+	}
+#endif // HTTPS_USE_WINSOCK
+
+#ifndef MSG_NOSIGNAL
+#	define MSG_NOSIGNAL 0
+#endif
+
+// What a gathered write takes on each system
+#ifdef HTTPS_USE_WINSOCK
+	typedef WSABUF Piece;
+
+	static Piece makePiece(const char *data, size_t size)
+	{
+		Piece piece;
+		piece.buf = const_cast<CHAR *>(data);
+		piece.len = (ULONG) size;
+		return piece;
+	}
+
+	static size_t pieceSize(const Piece &piece)
+	{
+		return piece.len;
+	}
+
+	static void skipInPiece(Piece &piece, size_t count)
+	{
+		piece.buf += count;
+		piece.len -= (ULONG) count;
+	}
+#else
+	typedef iovec Piece;
+
+	static Piece makePiece(const char *data, size_t size)
+	{
+		Piece piece;
+		piece.iov_base = const_cast<char *>(data);
+		piece.iov_len = size;
+		return piece;
+	}
+
+	static size_t pieceSize(const Piece &piece)
+	{
+		return piece.iov_len;
+	}
+
+	static void skipInPiece(Piece &piece, size_t count)
+	{
+		piece.iov_base = static_cast<char *>(piece.iov_base) + count;
+		piece.iov_len -= count;
+	}
 #endif // HTTPS_USE_WINSOCK
 
+constexpr std::chrono::milliseconds PlaintextConnection::attemptDelay;
+
 PlaintextConnection::PlaintextConnection()
 	: fd(-1)
+	, lastReadFailed(false)
+	, deadline(clock::time_point::max())
+	, idle(0)
+	, lastTimedOut(false)
 {
 #ifdef HTTPS_USE_WINSOCK
 	static bool wsaInit = false;
@@ -34,63 +109,402 @@ PlaintextConnection::PlaintextConnection()
 
 PlaintextConnection::~PlaintextConnection()
 {
-	if (fd != -1)
-		::close(fd);
+	PlaintextConnection::close();
+}
+
+// Alternates between address families, starting with the preferred one, so a
+// broken route for one family doesn't hold up the other (RFC 8305, section 4)
+static Resolver::AddressList interleave(const Resolver::AddressList &addresses, int preferredFamily)
+{
+	if (addresses.empty())
+		return addresses;
+
+	int firstFamily = preferredFamily != 0 ? preferredFamily : addresses.front().family;
+
+	Resolver::AddressList first, second, result;
+	for (const auto &address : addresses)
+		(address.family == firstFamily ? first : second).push_back(address);
+
+	for (size_t i = 0; i < first.size() || i < second.size(); ++i)
+	{
+		if (i < first.size())
+			result.push_back(first[i]);
+		if (i < second.size())
+			result.push_back(second[i]);
+	}
+
+	return result;
+}
+
+static bool setBlocking(int fd, bool blocking)
+{
+#ifdef HTTPS_USE_WINSOCK
+	u_long mode = blocking ? 0 : 1;
+	return ioctlsocket(fd, FIONBIO, &mode) == 0;
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1)
+		return false;
+
+	flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+	return fcntl(fd, F_SETFL, flags) == 0;
+#endif // HTTPS_USE_WINSOCK
+}
+
+static bool connectInProgress()
+{
+#ifdef HTTPS_USE_WINSOCK
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EINPROGRESS || errno == EINTR;
+#endif // HTTPS_USE_WINSOCK
+}
+
+static bool wouldBlock()
+{
+#ifdef HTTPS_USE_WINSOCK
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif // HTTPS_USE_WINSOCK
 }
 
 bool PlaintextConnection::connect(const std::string &hostname, uint16_t port)
 {
-	addrinfo hints;
-	std::memset(&hints, 0, sizeof(hints));
-	hints.ai_flags = hints.ai_protocol = 0;
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	lastTimedOut = false;
+	times = ConnectTimes();
 
-	addrinfo *addrs = nullptr;
-	std::string portString = std::to_string(port);
-	getaddrinfo(hostname.c_str(), portString.c_str(), &hints, &addrs);
+	Resolver &resolver = Resolver::getInstance();
+	Resolver::AddressList addresses = interleave(resolver.resolve(hostname, port), resolver.getPreferredFamily(hostname));
+	times.resolved = clock::now();
 
-	// Try all addresses returned
-	bool connected = false;
-	for (addrinfo *addr = addrs; !connected && addr; addr = addr->ai_next)
+	struct Attempt
 	{
-		fd = socket(addr->ai_family, SOCK_STREAM, 0);
-		connected = ::connect(fd, addr->ai_addr, addr->ai_addrlen) == 0;
-		if (!connected)
-			::close(fd);
+		int fd;
+		int family;
+	};
+
+	// Starts the next connection attempt every attemptDelay, or as soon as the
+	// previous one failed, and keeps whichever socket connects first
+	std::vector<Attempt> attempts;
+	std::vector<pollfd> pfds;
+	size_t next = 0;
+	auto nextStart = std::chrono::steady_clock::now();
+
+	while (fd == -1 && (next < addresses.size() || !attempts.empty()))
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline)
+		{
+			lastTimedOut = true;
+			break;
+		}
+
+		if (next < addresses.size() && (now >= nextStart || attempts.empty()))
+		{
+			const Resolver::Address &addr = addresses[next++];
+			int attemptFd = socket(addr.family, SOCK_STREAM, addr.protocol);
+			if (attemptFd == -1)
+				continue;
+
+			if (!setBlocking(attemptFd, false))
+			{
+				::close(attemptFd);
+				continue;
+			}
+
+			if (::connect(attemptFd, reinterpret_cast<const sockaddr *>(addr.sockaddr.data()), (socklen_t) addr.sockaddr.size()) == 0)
+			{
+				fd = attemptFd;
+				resolver.setPreferredFamily(hostname, addr.family);
+				break;
+			}
+
+			if (!connectInProgress())
+			{
+				::close(attemptFd);
+				continue;
+			}
+
+			attempts.push_back({attemptFd, addr.family});
+			nextStart = now + attemptDelay;
+		}
+
+		pfds.resize(attempts.size());
+		for (size_t i = 0; i < attempts.size(); ++i)
+		{
+			pfds[i].fd = attempts[i].fd;
+			pfds[i].events = POLLOUT;
+			pfds[i].revents = 0;
+		}
+
+		// Wait for a result, until the next attempt is due, or until out of time
+		auto until = next < addresses.size() ? std::min(nextStart, deadline) : deadline;
+		int timeout = -1;
+		if (until != clock::time_point::max())
+		{
+			auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(until - std::chrono::steady_clock::now()).count();
+			timeout = (int) std::max<long long>(wait + 1, 0);
+		}
+
+		if (::poll(pfds.data(), pfds.size(), timeout) < 0)
+		{
+#ifndef HTTPS_USE_WINSOCK
+			if (errno == EINTR)
+				continue;
+#endif // HTTPS_USE_WINSOCK
+			break;
+		}
+
+		for (size_t i = attempts.size(); i-- > 0; )
+		{
+			if (pfds[i].revents == 0)
+				continue;
+
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &length);
+
+			if (error == 0 && (pfds[i].revents & POLLOUT) && fd == -1)
+			{
+				fd = attempts[i].fd;
+				resolver.setPreferredFamily(hostname, attempts[i].family);
+			}
+			else
+				::close(attempts[i].fd);
+
+			attempts.erase(attempts.begin() + i);
+		}
 	}
 
-	freeaddrinfo(addrs);
+	// The race is over, the losers are dropped
+	for (const Attempt &attempt : attempts)
+		::close(attempt.fd);
 
-	if (!connected)
+	// Requests go out in as few writes as possible, there is nothing to gain
+	// from holding back the last piece of one until the previous is acknowledged
+	if (fd != -1)
 	{
-		fd = -1;
-		return false;
+		times.connected = clock::now();
+		Stats::add(Stats::CONNECTIONS_OPENED);
+
+		int noDelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&noDelay), sizeof(noDelay));
 	}
 
-	return true;
+	// The socket stays non-blocking, reads and writes wait in poll so they can time out
+	return fd != -1;
+}
+
+void PlaintextConnection::setTimeouts(clock::time_point deadline, std::chrono::milliseconds idle)
+{
+	this->deadline = deadline;
+	this->idle = idle;
+	lastTimedOut = false;
+}
+
+bool PlaintextConnection::timedOut() const
+{
+	return lastTimedOut;
+}
+
+int PlaintextConnection::waitTime() const
+{
+	long long wait = -1;
+
+	if (deadline != clock::time_point::max())
+	{
+		// Rounded up, so we don't wake up just short of it and spin
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count() + 1;
+		wait = std::max<long long>(left, 0);
+	}
+
+	if (idle.count() > 0 && (wait < 0 || idle.count() < wait))
+		wait = idle.count();
+
+	return (int) std::min<long long>(wait, 0x7fffffff);
+}
+
+bool PlaintextConnection::wait(bool forWrite)
+{
+	lastTimedOut = false;
+
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = forWrite ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+
+	while (true)
+	{
+		if (deadline != clock::time_point::max() && clock::now() >= deadline)
+		{
+			lastTimedOut = true;
+			return false;
+		}
+
+		int ready = ::poll(&pfd, 1, waitTime());
+		if (ready > 0)
+			return true;
+
+		if (ready == 0)
+		{
+			// Idle time ran out, or the deadline passed, which the next round catches
+			if (idle.count() > 0 && (deadline == clock::time_point::max() || clock::now() < deadline))
+			{
+				lastTimedOut = true;
+				return false;
+			}
+			continue;
+		}
+
+#ifndef HTTPS_USE_WINSOCK
+		if (errno == EINTR)
+			continue;
+#endif // HTTPS_USE_WINSOCK
+		return false;
+	}
 }
 
 size_t PlaintextConnection::read(char *buffer, size_t size)
 {
-	auto read = ::recv(fd, buffer, size, 0);
-	if (read < 0)
-		read = 0;
-	return static_cast<size_t>(read);
+	while (true)
+	{
+		auto read = ::recv(fd, buffer, size, 0);
+		if (read >= 0)
+		{
+			lastReadFailed = false;
+			return static_cast<size_t>(read);
+		}
+
+		if (!wouldBlock() || !wait(false))
+		{
+			lastReadFailed = true;
+			return 0;
+		}
+	}
+}
+
+bool PlaintextConnection::readFailed() const
+{
+	return lastReadFailed;
 }
 
 size_t PlaintextConnection::write(const char *buffer, size_t size)
 {
-	auto written = ::send(fd, buffer, size, 0);
-	if (written < 0)
-		written = 0;
-	return static_cast<size_t>(written);
+	while (true)
+	{
+		// A peer that closed a reused connection must not raise SIGPIPE
+		auto written = ::send(fd, buffer, size, MSG_NOSIGNAL);
+		if (written >= 0)
+			return static_cast<size_t>(written);
+
+		if (!wouldBlock() || !wait(true))
+			return 0;
+	}
+}
+
+bool PlaintextConnection::writeAll(const Buffer *buffers, size_t count)
+{
+	std::vector<Piece> pieces;
+	pieces.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (buffers[i].size > 0)
+			pieces.push_back(makePiece(buffers[i].data, buffers[i].size));
+	}
+
+	// Everything goes to the kernel in one call, sent pieces are skipped
+	// and a partly sent one continues where it stopped
+	size_t first = 0;
+	while (first < pieces.size())
+	{
+		size_t batch = pieces.size() - first;
+		if (batch > maxPieces)
+			batch = maxPieces;
+
+#ifdef HTTPS_USE_WINSOCK
+		DWORD sent = 0;
+		long long written = WSASend(fd, &pieces[first], (DWORD) batch, &sent, 0, nullptr, nullptr) == 0 ? (long long) sent : -1;
+#else
+		msghdr message = {};
+		message.msg_iov = &pieces[first];
+		message.msg_iovlen = batch;
+		ssize_t written = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+#endif // HTTPS_USE_WINSOCK
+
+		if (written < 0)
+		{
+			if (!wouldBlock() || !wait(true))
+				return false;
+			continue;
+		}
+
+		size_t left = (size_t) written;
+		while (left > 0 && left >= pieceSize(pieces[first]))
+			left -= pieceSize(pieces[first++]);
+		if (left > 0)
+			skipInPiece(pieces[first], left);
+	}
+
+	return true;
+}
+
+uint64_t PlaintextConnection::writeFile(FileReader &file, uint64_t count)
+{
+#ifdef __linux__
+	// sendfile has no MSG_NOSIGNAL
+	SigpipeGuard guard;
+
+	// The kernel copies straight from the page cache to the socket
+	uint64_t sent = 0;
+	while (sent < count)
+	{
+		size_t chunk = (size_t) std::min<uint64_t>(count - sent, 0x40000000);
+		ssize_t written = sendfile(fd, file.getFd(), nullptr, chunk);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait(true))
+			continue;
+		if (written <= 0)
+			break;
+
+		sent += (uint64_t) written;
+	}
+
+	return sent;
+#else
+	return Connection::writeFile(file, count);
+#endif
 }
 
 void PlaintextConnection::close()
 {
+	if (fd == -1)
+		return;
+
 	::close(fd);
 	fd = -1;
+	Stats::add(Stats::CONNECTIONS_CLOSED);
+}
+
+bool PlaintextConnection::isAlive()
+{
+	if (fd == -1)
+		return false;
+
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	// An idle connection has nothing to read, if it is readable the peer
+	// either closed it or sent something we can't make sense of
+	return ::poll(&pfd, 1, 0) == 0;
+}
+
+Connection::ConnectTimes PlaintextConnection::getConnectTimes() const
+{
+	return times;
 }
 
 int PlaintextConnection::getFd() const
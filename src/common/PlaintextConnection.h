@@ -1,5 +1,7 @@
 #pragma once
 
+#include <chrono>
+
 #include "Connection.h"
 
 class PlaintextConnection : public Connection
@@ -9,11 +11,38 @@ public:
 	virtual bool connect(const std::string &hostname, uint16_t port);
 	virtual size_t read(char *buffer, size_t size);
 	virtual size_t write(const char *buffer, size_t size);
+	virtual bool writeAll(const Buffer *buffers, size_t count);
 	virtual void close();
+	virtual uint64_t writeFile(FileReader &file, uint64_t count);
+	virtual bool readFailed() const;
+	virtual void setTimeouts(clock::time_point deadline, std::chrono::milliseconds idle);
+	virtual bool timedOut() const;
+	virtual bool isAlive();
+	virtual ConnectTimes getConnectTimes() const;
 	virtual ~PlaintextConnection();
 
 	int getFd() const;
 
+	// The socket is non-blocking once connected, this waits until it is
+	// readable or writable. Returns false on errors and once out of time.
+	bool wait(bool forWrite);
+
 private:
+	// How long the next wait may take in milliseconds, -1 for no limit
+	int waitTime() const;
+
+	// Well below the limit on pieces in one gathered write on any system
+	static const size_t maxPieces = 64;
+
+	// How long an attempt gets before the next address is tried alongside it
+	static constexpr std::chrono::milliseconds attemptDelay = std::chrono::milliseconds(250);
+
 	int fd;
+	bool lastReadFailed;
+
+	clock::time_point deadline;
+	std::chrono::milliseconds idle;
+	bool lastTimedOut;
+
+	ConnectTimes times;
 };
@@ -0,0 +1,256 @@
+#include "config.h"
+#include "Resolver.h"
+
+#include <cstring>
+
+#ifndef HTTPS_USE_WINSOCK
+#	include <netdb.h>
+#	include <sys/types.h>
+#	include <sys/socket.h>
+#	include <netinet/in.h>
+#else
+#	include <winsock2.h>
+#	include <ws2tcpip.h>
+#endif // HTTPS_USE_WINSOCK
+
+Resolver &Resolver::getInstance()
+{
+	// Never destroyed, the refresh thread may still be inside getaddrinfo at exit
+	static Resolver *instance = new Resolver();
+	return *instance;
+}
+
+Resolver::Resolver()
+	: ttl(std::chrono::seconds(60))
+	, negativeTTL(std::chrono::seconds(5))
+{
+#ifdef HTTPS_USE_WINSOCK
+	// The refresh thread may resolve before any socket was created
+	WSADATA data;
+	WSAStartup(MAKEWORD(2, 2), &data);
+#endif // HTTPS_USE_WINSOCK
+}
+
+Resolver::AddressList Resolver::resolve(const std::string &hostname, uint16_t port, std::string *error)
+{
+	std::shared_ptr<const AddressList> addresses;
+	bool found = false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto now = clock::now();
+		auto it = cache.find(hostname);
+
+		if (it != cache.end() && now < it->second.expires)
+		{
+			Entry &entry = it->second;
+			addresses = entry.addresses;
+			found = true;
+
+			if (!addresses && error)
+				*error = entry.error;
+
+			// Within the last fifth of its lifetime, refresh it before anyone has to wait
+			if (addresses && !entry.refreshing && now > entry.expires - (entry.expires - entry.resolved) / 5)
+			{
+				entry.refreshing = true;
+				pending.push_back(hostname);
+				if (!thread.joinable())
+					thread = std::thread(&Resolver::refreshLoop, this);
+				wakeup.notify_one();
+			}
+		}
+	}
+
+	if (!found)
+	{
+		Entry entry;
+		lookup(hostname, entry);
+		store(hostname, entry);
+
+		addresses = entry.addresses;
+		if (!addresses && error)
+			*error = entry.error;
+	}
+
+	AddressList result;
+	if (!addresses)
+		return result;
+
+	result = *addresses;
+	for (Address &address : result)
+	{
+		if (address.family == AF_INET)
+			reinterpret_cast<sockaddr_in *>(&address.sockaddr[0])->sin_port = htons(port);
+		else if (address.family == AF_INET6)
+			reinterpret_cast<sockaddr_in6 *>(&address.sockaddr[0])->sin6_port = htons(port);
+	}
+
+	return result;
+}
+
+void Resolver::prefetch(const std::string &hostname)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = cache.find(hostname);
+	if (it != cache.end() && (it->second.refreshing || clock::now() < it->second.expires))
+		return;
+
+	pending.push_back(hostname);
+	if (!thread.joinable())
+		thread = std::thread(&Resolver::refreshLoop, this);
+	wakeup.notify_one();
+}
+
+int Resolver::getPreferredFamily(const std::string &hostname)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = preferredFamilies.find(hostname);
+	return it != preferredFamilies.end() ? it->second : 0;
+}
+
+void Resolver::setPreferredFamily(const std::string &hostname, int family)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Only a hint, forgetting everything once in a while is fine
+	if (preferredFamilies.size() >= maxEntries && preferredFamilies.find(hostname) == preferredFamilies.end())
+		preferredFamilies.clear();
+
+	preferredFamilies[hostname] = family;
+}
+
+void Resolver::setTTL(clock::duration ttl, clock::duration negativeTTL)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	this->ttl = ttl;
+	this->negativeTTL = negativeTTL;
+	cache.clear();
+}
+
+Resolver::clock::duration Resolver::getTTL()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return ttl;
+}
+
+void Resolver::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	cache.clear();
+	preferredFamilies.clear();
+}
+
+void Resolver::lookup(const std::string &hostname, Entry &entry)
+{
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = hints.ai_protocol = 0;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo *addrs = nullptr;
+	int result = getaddrinfo(hostname.c_str(), nullptr, &hints, &addrs);
+
+	entry.resolved = clock::now();
+	entry.refreshing = false;
+
+	if (result != 0 || !addrs)
+	{
+		entry.error = "Could not resolve " + hostname + ": " + (result != 0 ? gai_strerror(result) : "no addresses");
+		entry.addresses.reset();
+		return;
+	}
+
+	std::shared_ptr<AddressList> addresses = std::make_shared<AddressList>();
+	for (addrinfo *addr = addrs; addr; addr = addr->ai_next)
+	{
+		if (addr->ai_family != AF_INET && addr->ai_family != AF_INET6)
+			continue;
+
+		Address address;
+		address.family = addr->ai_family;
+		address.protocol = addr->ai_protocol;
+		address.sockaddr.assign(reinterpret_cast<const char *>(addr->ai_addr), addr->ai_addrlen);
+		addresses->push_back(std::move(address));
+	}
+
+	freeaddrinfo(addrs);
+	entry.addresses = std::move(addresses);
+}
+
+void Resolver::store(const std::string &hostname, const Entry &resolved)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	clock::duration lifetime = resolved.addresses ? ttl : negativeTTL;
+	if (ttl == clock::duration::zero() || lifetime == clock::duration::zero())
+	{
+		cache.erase(hostname);
+		return;
+	}
+
+	if (cache.size() >= maxEntries && cache.find(hostname) == cache.end())
+	{
+		// Make room, preferably by dropping what expired already
+		auto now = clock::now();
+		for (auto it = cache.begin(); it != cache.end(); )
+		{
+			if (it->second.expires <= now)
+				it = cache.erase(it);
+			else
+				++it;
+		}
+
+		if (cache.size() >= maxEntries)
+		{
+			auto oldest = cache.begin();
+			for (auto it = cache.begin(); it != cache.end(); ++it)
+			{
+				if (it->second.expires < oldest->second.expires)
+					oldest = it;
+			}
+
+			cache.erase(oldest);
+		}
+	}
+
+	Entry &entry = cache[hostname];
+	entry = resolved;
+	entry.expires = resolved.resolved + lifetime;
+}
+
+void Resolver::refreshLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true)
+	{
+		wakeup.wait(lock, [this]() { return !pending.empty(); });
+
+		std::string hostname = std::move(pending.front());
+		pending.pop_front();
+
+		lock.unlock();
+
+		Entry entry;
+		lookup(hostname, entry);
+
+		// A failed refresh keeps the old addresses until they expire
+		bool cached = false;
+		if (!entry.addresses)
+		{
+			std::lock_guard<std::mutex> refreshLock(mutex);
+			auto it = cache.find(hostname);
+			cached = it != cache.end();
+			if (cached)
+				it->second.refreshing = false;
+		}
+
+		if (!cached)
+			store(hostname, entry);
+
+		lock.lock();
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Caches getaddrinfo results, including failures, for the sockets opened by
+// the built-in connections. Entries about to expire are refreshed in the
+// background when they are used, so busy hosts never wait for the resolver.
+class Resolver
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	struct Address
+	{
+		int family;
+		int protocol;
+		// A sockaddr of the family, with the port filled in
+		std::string sockaddr;
+	};
+
+	typedef std::vector<Address> AddressList;
+
+	static Resolver &getInstance();
+
+	// Returns the addresses of the host, empty if it can't be resolved. The
+	// reason is stored in error then.
+	AddressList resolve(const std::string &hostname, uint16_t port, std::string *error = nullptr);
+	// Resolves the host in the background, so a later request finds it cached
+	void prefetch(const std::string &hostname);
+
+	// The address family that connected first last time, 0 if there is none yet
+	int getPreferredFamily(const std::string &hostname);
+	void setPreferredFamily(const std::string &hostname, int family);
+
+	// A ttl of zero turns the cache off
+	void setTTL(clock::duration ttl, clock::duration negativeTTL);
+	clock::duration getTTL();
+	void clear();
+
+private:
+	struct Entry
+	{
+		// Empty if the lookup failed
+		std::shared_ptr<const AddressList> addresses;
+		std::string error;
+		clock::time_point resolved;
+		clock::time_point expires;
+		bool refreshing;
+	};
+
+	Resolver();
+	~Resolver() = delete;
+
+	void lookup(const std::string &hostname, Entry &entry);
+	void store(const std::string &hostname, const Entry &entry);
+	void queueRefresh(const std::string &hostname);
+	void refreshLoop();
+
+	static const size_t maxEntries = 256;
+
+	std::mutex mutex;
+	std::map<std::string, Entry> cache;
+	std::map<std::string, int> preferredFamilies;
+	clock::duration ttl;
+	clock::duration negativeTTL;
+
+	// Refreshes and prefetches run on one thread, started on first use
+	std::condition_variable wakeup;
+	std::deque<std::string> pending;
+	std::thread thread;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#ifdef __linux__
+#	include <cerrno>
+#	include <csignal>
+#	include <ctime>
+#	include <pthread.h>
+
+// Writes that can't pass MSG_NOSIGNAL, like sendfile or those made by a TLS
+// library, hold SIGPIPE back on this thread while they run
+struct SigpipeGuard
+{
+	sigset_t pipeSet;
+	sigset_t oldSet;
+	bool wasPending;
+
+	SigpipeGuard()
+	{
+		sigset_t pending;
+		sigemptyset(&pending);
+		sigpending(&pending);
+		wasPending = sigismember(&pending, SIGPIPE) == 1;
+
+		sigemptyset(&pipeSet);
+		sigaddset(&pipeSet, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+	}
+
+	~SigpipeGuard()
+	{
+		// Swallow the signal we caused, but not one that was already there
+		if (!wasPending)
+		{
+			timespec zero = {0, 0};
+			while (sigtimedwait(&pipeSet, nullptr, &zero) == -1 && errno == EINTR);
+		}
+
+		pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+	}
+};
+#else
+// Elsewhere there is no SIGPIPE, or MSG_NOSIGNAL is all there is
+struct SigpipeGuard
+{
+	SigpipeGuard() {}
+};
+#endif // __linux__
@@ -0,0 +1,323 @@
+#include "Stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <unordered_map>
+
+namespace
+{
+	using Stats::Histogram;
+
+	// Hosts get a histogram each, up to this many, the rest share the last one
+	const size_t maxHosts = 256;
+	const char *const otherHosts = "*";
+	// Per thread, so a program that talks to many hosts doesn't grow it forever
+	const size_t maxCachedHostIds = 1024;
+
+	// Counters are only ever written by the thread they belong to, so a plain
+	// load and store is enough. Being atomic keeps readers from tearing them.
+	void bump(std::atomic<uint64_t> &value, uint64_t amount)
+	{
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	struct HostLatency
+	{
+		HostLatency()
+		{
+			for (auto &bucket : buckets)
+				bucket.store(0, std::memory_order_relaxed);
+			totalMicros.store(0, std::memory_order_relaxed);
+		}
+
+		std::atomic<uint64_t> buckets[Histogram::bucketCount];
+		std::atomic<uint64_t> totalMicros;
+	};
+
+	struct Block
+	{
+		Block()
+		{
+			for (auto &counter : counters)
+				counter.store(0, std::memory_order_relaxed);
+			for (auto &host : hosts)
+				host.store(nullptr, std::memory_order_relaxed);
+		}
+
+		~Block()
+		{
+			for (auto &host : hosts)
+				delete host.load(std::memory_order_relaxed);
+		}
+
+		std::atomic<uint64_t> counters[Stats::COUNTER_MAX];
+		// By host id, created by the owning thread on its first request there
+		std::atomic<HostLatency *> hosts[maxHosts];
+	};
+
+	struct Totals
+	{
+		uint64_t counters[Stats::COUNTER_MAX] = {};
+		std::vector<Histogram> hosts;
+
+		void add(const Block &block, size_t hostCount)
+		{
+			for (int i = 0; i < Stats::COUNTER_MAX; ++i)
+				counters[i] += block.counters[i].load(std::memory_order_relaxed);
+
+			if (hosts.size() < hostCount)
+				hosts.resize(hostCount);
+
+			for (size_t i = 0; i < hostCount; ++i)
+			{
+				const HostLatency *latency = block.hosts[i].load(std::memory_order_acquire);
+				if (!latency)
+					continue;
+
+				Histogram &histogram = hosts[i];
+				for (int j = 0; j < Histogram::bucketCount; ++j)
+				{
+					uint64_t count = latency->buckets[j].load(std::memory_order_relaxed);
+					histogram.buckets[j] += count;
+					histogram.count += count;
+				}
+				histogram.totalMicros += latency->totalMicros.load(std::memory_order_relaxed);
+			}
+		}
+	};
+
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<const Block *> blocks;
+		// What threads that exited counted
+		Totals retired;
+		// Taken on reset, and taken off what is read after it
+		Totals baseline;
+
+		std::unordered_map<std::string, size_t> hostIds;
+		std::vector<std::string> hostNames;
+
+		// Needs the mutex
+		Totals sum() const
+		{
+			Totals totals = retired;
+			for (const Block *block : blocks)
+				totals.add(*block, hostNames.size());
+			totals.hosts.resize(hostNames.size());
+			return totals;
+		}
+	};
+
+	Registry &getRegistry()
+	{
+		// Never destroyed, threads may still count while the process exits
+		static Registry *registry = new Registry();
+		return *registry;
+	}
+
+	// Signs the thread's block up on its first count, and hands what it
+	// counted over to the registry when the thread exits
+	struct ThreadBlock
+	{
+		ThreadBlock()
+			: registry(getRegistry())
+		{
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.blocks.push_back(&block);
+		}
+
+		~ThreadBlock()
+		{
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.retired.add(block, registry.hostNames.size());
+			registry.blocks.erase(std::find(registry.blocks.begin(), registry.blocks.end(), &block));
+		}
+
+		size_t hostId(const std::string &host)
+		{
+			auto cached = hostIds.find(host);
+			if (cached != hostIds.end())
+				return cached->second;
+
+			size_t id;
+			{
+				std::lock_guard<std::mutex> lock(registry.mutex);
+
+				bool full = registry.hostNames.size() >= maxHosts - 1;
+				std::string name = full ? otherHosts : host;
+
+				auto known = registry.hostIds.find(host);
+				if (known == registry.hostIds.end())
+					known = registry.hostIds.find(name);
+
+				if (known != registry.hostIds.end())
+					id = known->second;
+				else
+				{
+					id = registry.hostNames.size();
+					registry.hostNames.push_back(name);
+					registry.hostIds[name] = id;
+				}
+			}
+
+			if (hostIds.size() < maxCachedHostIds)
+				hostIds[host] = id;
+
+			return id;
+		}
+
+		Registry &registry;
+		Block block;
+		// Looked up before, so the registry is only locked for new hosts
+		std::unordered_map<std::string, size_t> hostIds;
+	};
+
+	ThreadBlock &getThreadBlock()
+	{
+		static thread_local ThreadBlock block;
+		return block;
+	}
+
+	// The host and port as written in the url
+	std::string hostOf(const std::string &url)
+	{
+		size_t start = url.find("://");
+		start = start == std::string::npos ? 0 : start + 3;
+
+		size_t end = url.find_first_of("/?#", start);
+		if (end == std::string::npos)
+			end = url.size();
+
+		size_t at = url.rfind('@', end);
+		if (at != std::string::npos && at >= start)
+			start = at + 1;
+
+		return url.substr(start, end - start);
+	}
+}
+
+int Histogram::bucketOf(uint64_t micros)
+{
+	if (micros < subBuckets)
+		return (int) micros;
+
+	// The highest bit picks the power of two, the bits below it the bucket within
+	int exponent = subBits;
+	while (exponent < 63 && (micros >> (exponent + 1)) != 0)
+		++exponent;
+
+	if (exponent >= maxExponent)
+		return bucketCount - 1;
+
+	int sub = (int) (micros >> (exponent - subBits)) & (subBuckets - 1);
+	return (exponent - subBits + 1) * subBuckets + sub;
+}
+
+uint64_t Histogram::bucketEnd(int bucket)
+{
+	if (bucket < subBuckets)
+		return (uint64_t) bucket + 1;
+
+	int exponent = bucket / subBuckets + subBits - 1;
+	uint64_t sub = (uint64_t) (bucket % subBuckets);
+	return (subBuckets + sub + 1) << (exponent - subBits);
+}
+
+uint64_t Histogram::percentile(double fraction) const
+{
+	if (count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t) std::ceil(fraction * (double) count);
+	rank = std::min(std::max<uint64_t>(rank, 1), count);
+
+	uint64_t seen = 0;
+	for (int i = 0; i < bucketCount; ++i)
+	{
+		seen += buckets[i];
+		if (seen >= rank)
+			return bucketEnd(i);
+	}
+
+	return bucketEnd(bucketCount - 1);
+}
+
+void Stats::add(Counter counter, uint64_t amount)
+{
+	bump(getThreadBlock().block.counters[counter], amount);
+}
+
+void Stats::recordReply(const std::string &url, const HTTPSClient::Reply &reply, double seconds)
+{
+	ThreadBlock &thread = getThreadBlock();
+	Block &block = thread.block;
+
+	bump(block.counters[BYTES_SENT], reply.timings.bytesSent);
+	bump(block.counters[BYTES_RECEIVED], reply.timings.bytesReceived);
+
+	if (reply.responseCode == 0)
+	{
+		bump(block.counters[ERRORS_CONNECT], 1);
+		return;
+	}
+
+	int statusClass = reply.responseCode / 100;
+	if (statusClass >= 1 && statusClass <= 5)
+		bump(block.counters[REQUESTS_1XX + statusClass - 1], 1);
+
+	if (!reply.error.empty())
+		bump(block.counters[ERRORS_RESPONSE], 1);
+
+	size_t id = thread.hostId(hostOf(url));
+	HostLatency *latency = block.hosts[id].load(std::memory_order_relaxed);
+	if (!latency)
+	{
+		latency = new HostLatency();
+		block.hosts[id].store(latency, std::memory_order_release);
+	}
+
+	uint64_t micros = (uint64_t) std::llround(std::max(seconds, 0.0) * 1e6);
+	bump(latency->buckets[Histogram::bucketOf(micros)], 1);
+	bump(latency->totalMicros, micros);
+}
+
+Stats::Snapshot Stats::read()
+{
+	Registry &registry = getRegistry();
+	Snapshot snapshot;
+
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	Totals totals = registry.sum();
+
+	for (int i = 0; i < COUNTER_MAX; ++i)
+		snapshot.counters[i] = totals.counters[i] - registry.baseline.counters[i];
+
+	for (size_t i = 0; i < totals.hosts.size(); ++i)
+	{
+		Histogram histogram = totals.hosts[i];
+		if (i < registry.baseline.hosts.size())
+		{
+			const Histogram &before = registry.baseline.hosts[i];
+			for (int j = 0; j < Histogram::bucketCount; ++j)
+				histogram.buckets[j] -= before.buckets[j];
+			histogram.count -= before.count;
+			histogram.totalMicros -= before.totalMicros;
+		}
+
+		if (histogram.count > 0)
+			snapshot.latency.emplace_back(registry.hostNames[i], histogram);
+	}
+
+	return snapshot;
+}
+
+void Stats::reset()
+{
+	Registry &registry = getRegistry();
+
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.baseline = registry.sum();
+}
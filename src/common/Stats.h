@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "HTTPSClient.h"
+
+// Process-wide counters for every backend. Each thread counts into a block of
+// its own without locking or waiting on anyone, reading adds the blocks up.
+namespace Stats
+{
+	enum Counter
+	{
+		// Requests that got a response, by the first digit of its status
+		REQUESTS_1XX,
+		REQUESTS_2XX,
+		REQUESTS_3XX,
+		REQUESTS_4XX,
+		REQUESTS_5XX,
+
+		// No connection, or no response on it
+		ERRORS_CONNECT,
+		ERRORS_TIMEOUT,
+		// The response was cut off or could not be parsed or decoded
+		ERRORS_RESPONSE,
+		// Anything else that was thrown, such as unknown url schemas
+		ERRORS_OTHER,
+
+		CONNECTIONS_OPENED,
+		CONNECTIONS_REUSED,
+		CONNECTIONS_CLOSED,
+
+		TLS_FULL,
+		TLS_RESUMED,
+
+		BYTES_SENT,
+		BYTES_RECEIVED,
+
+		COUNTER_MAX
+	};
+
+	// Latencies in microseconds, in buckets that are never more than 1/8th of
+	// their lower bound wide, so any value read back is within 12.5%.
+	struct Histogram
+	{
+		static const int subBits = 3;
+		static const int subBuckets = 1 << subBits;
+		// Up to 2^40 microseconds, about 12 days, longer ones go in the last bucket
+		static const int maxExponent = 40;
+		static const int bucketCount = (maxExponent - subBits + 1) * subBuckets;
+
+		static int bucketOf(uint64_t micros);
+		// The first value of the next bucket
+		static uint64_t bucketEnd(int bucket);
+
+		// The value below which the fraction of the latencies lie, 0 if empty
+		uint64_t percentile(double fraction) const;
+
+		uint64_t buckets[bucketCount] = {};
+		uint64_t count = 0;
+		uint64_t totalMicros = 0;
+	};
+
+	struct Snapshot
+	{
+		uint64_t counters[COUNTER_MAX] = {};
+		// By host, only those with requests since the last reset
+		std::vector<std::pair<std::string, Histogram>> latency;
+	};
+
+	void add(Counter counter, uint64_t amount = 1);
+
+	// Counts a finished request, and how long it took towards its host's latencies
+	void recordReply(const std::string &url, const HTTPSClient::Reply &reply, double seconds);
+
+	Snapshot read();
+	// Counts start from 0 again
+	void reset();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+
+// A piece of memory owned by someone else, like std::string_view, which
+// C++14 doesn't have yet. Only valid as long as the owner keeps it around.
+struct StringRef
+{
+	StringRef() : data(""), size(0) {}
+	StringRef(const char *data, size_t size) : data(data), size(size) {}
+	StringRef(const char *str) : data(str), size(strlen(str)) {}
+	StringRef(const std::string &str) : data(str.data()), size(str.size()) {}
+
+	const char *data;
+	size_t size;
+
+	bool empty() const { return size == 0; }
+	std::string str() const { return std::string(data, size); }
+
+	bool operator==(StringRef other) const
+	{
+		return size == other.size && memcmp(data, other.data, size) == 0;
+	}
+
+	bool operator!=(StringRef other) const
+	{
+		return !(*this == other);
+	}
+};
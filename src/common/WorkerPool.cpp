@@ -0,0 +1,74 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(size_t threadCount, size_t maxQueued)
+	: threadCount(threadCount)
+	, maxQueued(maxQueued)
+	, state(std::make_shared<State>())
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	std::deque<Queued> abandoned;
+
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->stopping = true;
+		abandoned.swap(state->queue);
+	}
+
+	state->wakeup.notify_all();
+
+	// Nobody would ever see these finish
+	for (auto &queued : abandoned)
+	{
+		if (queued.async)
+			queued.async->fail("Shutting down");
+	}
+
+	// A worker may be stuck in a connect or read for a long time, rather than
+	// waiting for it, it is left to exit on its own
+	for (auto &thread : threads)
+		thread.detach();
+}
+
+bool WorkerPool::submit(const std::shared_ptr<AsyncRequest> &async, Job job)
+{
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+
+		if (state->stopping || state->queue.size() >= maxQueued)
+			return false;
+
+		state->queue.push_back({async, std::move(job)});
+
+		// Threads are only started once there is work for them
+		if (threads.empty())
+			for (size_t i = 0; i < threadCount; ++i)
+				threads.emplace_back(&WorkerPool::work, state);
+	}
+
+	state->wakeup.notify_one();
+	return true;
+}
+
+void WorkerPool::work(std::shared_ptr<State> state)
+{
+	while (true)
+	{
+		Job job;
+
+		{
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->wakeup.wait(lock, [&state]() { return state->stopping || !state->queue.empty(); });
+
+			if (state->stopping)
+				return;
+
+			job = std::move(state->queue.front().job);
+			state->queue.pop_front();
+		}
+
+		job();
+	}
+}
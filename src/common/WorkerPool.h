@@ -0,0 +1,50 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "AsyncRequest.h"
+
+// A fixed set of threads working through a bounded queue of jobs
+class WorkerPool
+{
+public:
+	typedef std::function<void()> Job;
+
+	WorkerPool(size_t threadCount, size_t maxQueued);
+	~WorkerPool();
+
+	// Returns false if the queue is full. The request, if the job has one, is
+	// failed instead if the pool is destroyed before the job started.
+	bool submit(const std::shared_ptr<AsyncRequest> &async, Job job);
+
+private:
+	struct Queued
+	{
+		std::shared_ptr<AsyncRequest> async;
+		Job job;
+	};
+
+	// Outlives the pool while a worker still holds it
+	struct State
+	{
+		bool stopping = false;
+
+		std::mutex mutex;
+		std::condition_variable wakeup;
+		std::deque<Queued> queue;
+	};
+
+	static void work(std::shared_ptr<State> state);
+
+	size_t threadCount;
+	size_t maxQueued;
+
+	std::shared_ptr<State> state;
+	std::vector<std::thread> threads;
+};
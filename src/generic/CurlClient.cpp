@@ -4,14 +4,55 @@
 
 #include <algorithm>
 #include <stdexcept>
-#include <sstream>
 #include <vector>
+#ifdef HTTPS_USE_WINSOCK
+#	include <winsock2.h>
+#else
+#	include <unistd.h>
+#endif
 
-typedef struct StringReader
+#include "../common/AsyncRequest.h"
+#include "../common/FileReader.h"
+#include "../common/Resolver.h"
+#include "../common/Stats.h"
+
+// Everything curl points to while a transfer is running
+struct CurlClient::Transfer
 {
-	const std::string *str;
-	size_t pos;
-} StringReader;
+	Transfer(CURL *handle, const HTTPSClient::Request &req)
+		: handle(handle)
+		, req(req)
+		, bodyPos(0)
+		, sendHeaders(nullptr)
+		, headersDelivered(false)
+		, aborted(false)
+		, timedOut(false)
+	{
+		reply.responseCode = 0;
+	}
+
+	CURL *handle;
+	const HTTPSClient::Request &req;
+	std::shared_ptr<AsyncRequest> async;
+
+	// Where the upload is read from, postdata or the current chunk from the source
+	std::unique_ptr<FileReader> file;
+	std::string chunk;
+	size_t bodyPos;
+
+	// Curl doesn't copy memory, keep the strings around
+	std::vector<std::string> lines;
+	curl_slist *sendHeaders;
+	std::shared_ptr<const std::string> bundle;
+#if LIBCURL_VERSION_NUM >= 0x074d00
+	curl_blob caBlob;
+#endif
+
+	bool headersDelivered;
+	bool aborted;
+	bool timedOut;
+	HTTPSClient::Reply reply;
+};
 
 CurlClient::Curl::Curl()
 : handle(nullptr)
@@ -19,11 +60,33 @@ CurlClient::Curl::Curl()
 , global_cleanup(nullptr)
 , easy_init(nullptr)
 , easy_cleanup(nullptr)
+, easy_reset(nullptr)
 , easy_setopt(nullptr)
 , easy_perform(nullptr)
 , easy_getinfo(nullptr)
+, easy_strerror(nullptr)
 , slist_append(nullptr)
 , slist_free_all(nullptr)
+, multiLoaded(false)
+, multi_init(nullptr)
+, multi_cleanup(nullptr)
+, multi_add_handle(nullptr)
+, multi_remove_handle(nullptr)
+, multi_perform(nullptr)
+, multi_info_read(nullptr)
+, multi_setopt(nullptr)
+, multi_poll(nullptr)
+, multi_wakeup(nullptr)
+{
+}
+
+bool CurlClient::Curl::load()
+{
+	std::call_once(loadFlag, [this]() { open(); });
+	return loaded;
+}
+
+void CurlClient::Curl::open()
 {
 	using namespace LibraryLoader;
 
@@ -45,17 +108,31 @@ CurlClient::Curl::Curl()
 		return;
 	if (!LoadSymbol(easy_cleanup, handle, "curl_easy_cleanup"))
 		return;
+	if (!LoadSymbol(easy_reset, handle, "curl_easy_reset"))
+		return;
 	if (!LoadSymbol(easy_setopt, handle, "curl_easy_setopt"))
 		return;
 	if (!LoadSymbol(easy_perform, handle, "curl_easy_perform"))
 		return;
 	if (!LoadSymbol(easy_getinfo, handle, "curl_easy_getinfo"))
 		return;
+	if (!LoadSymbol(easy_strerror, handle, "curl_easy_strerror"))
+		return;
 	if (!LoadSymbol(slist_append, handle, "curl_slist_append"))
 		return;
 	if (!LoadSymbol(slist_free_all, handle, "curl_slist_free_all"))
 		return;
 
+	multiLoaded = LoadSymbol(multi_init, handle, "curl_multi_init")
+		&& LoadSymbol(multi_cleanup, handle, "curl_multi_cleanup")
+		&& LoadSymbol(multi_add_handle, handle, "curl_multi_add_handle")
+		&& LoadSymbol(multi_remove_handle, handle, "curl_multi_remove_handle")
+		&& LoadSymbol(multi_perform, handle, "curl_multi_perform")
+		&& LoadSymbol(multi_info_read, handle, "curl_multi_info_read")
+		&& LoadSymbol(multi_setopt, handle, "curl_multi_setopt")
+		&& LoadSymbol(multi_poll, handle, "curl_multi_poll")
+		&& LoadSymbol(multi_wakeup, handle, "curl_multi_wakeup");
+
 	global_init(CURL_GLOBAL_DEFAULT);
 	loaded = true;
 }
@@ -69,125 +146,633 @@ CurlClient::Curl::~Curl()
 		LibraryLoader::CloseLibrary(handle);
 }
 
+// An easy handle keeps its connection, DNS and TLS session caches, so each
+// thread holds on to one and resets it between requests
+struct CachedHandle
+{
+	CURL *handle = nullptr;
+	bool inUse = false;
+	decltype(&curl_easy_cleanup) cleanup = nullptr;
+
+	~CachedHandle()
+	{
+		if (handle)
+			cleanup(handle);
+	}
+};
+
+static thread_local CachedHandle cachedHandle;
+
+// Curl only says how many connections a transfer opened, closing happens
+// whenever it decides to drop one from its cache
+static int closeSocket(void *, curl_socket_t fd)
+{
+	Stats::add(Stats::CONNECTIONS_CLOSED);
+#ifdef HTTPS_USE_WINSOCK
+	return closesocket(fd);
+#else
+	return close(fd);
+#endif
+}
+
 static char toUppercase(char c)
 {
 	int ch = (unsigned char) c;
 	return toupper(ch);
 }
 
-static size_t stringReader(char *ptr, size_t size, size_t nmemb, StringReader *reader)
+size_t CurlClient::bodyReader(char *ptr, size_t size, size_t nmemb, Transfer *transfer)
 {
-	const char *data = reader->str->data();
-	size_t len = reader->str->length();
-	size_t maxCount = (len - reader->pos) / size;
-	size_t desiredCount = std::min(maxCount, nmemb);
-	size_t desiredBytes = desiredCount * size;
+	size_t count = size*nmemb;
+	const HTTPSClient::Request &req = transfer->req;
 
-	std::copy(data + reader->pos, data + desiredBytes, ptr);
-	reader->pos += desiredBytes;
+	if (transfer->file)
+		return transfer->file->read(ptr, count);
 
-	return desiredCount;
+	StringRef data = req.postdata;
+	if (req.source)
+	{
+		// Chunks can be larger than curl's buffer, the rest waits for the next call
+		if (transfer->bodyPos == transfer->chunk.size())
+		{
+			transfer->chunk.clear();
+			transfer->bodyPos = 0;
+
+			if (!req.source(transfer->chunk))
+			{
+				transfer->aborted = true;
+				return CURL_READFUNC_ABORT;
+			}
+		}
+
+		data = transfer->chunk;
+	}
+
+	count = std::min(count, data.size - transfer->bodyPos);
+	std::copy(data.data + transfer->bodyPos, data.data + transfer->bodyPos + count, ptr);
+	transfer->bodyPos += count;
+
+	return count;
 }
 
-static size_t stringstreamWriter(char *ptr, size_t size, size_t nmemb, std::stringstream *ss)
+bool CurlClient::deliverHeaders(Transfer &transfer)
+{
+	if (transfer.headersDelivered)
+		return !transfer.aborted;
+
+	transfer.headersDelivered = true;
+
+	long responseCode;
+	curl.easy_getinfo(transfer.handle, CURLINFO_RESPONSE_CODE, &responseCode);
+	transfer.reply.responseCode = (int) responseCode;
+
+	// Curl undoes Content-Encoding itself, then the length is that of the encoded body
+	if (!transfer.req.decompress && transfer.req.method != "HEAD")
+		reserveBody(transfer.req, transfer.reply);
+
+	if (transfer.req.onHeaders && !transfer.req.onHeaders(transfer.reply.responseCode, transfer.reply.headers))
+		transfer.aborted = true;
+
+	return !transfer.aborted;
+}
+
+size_t CurlClient::bodyWriter(char *ptr, size_t size, size_t nmemb, Transfer *transfer)
 {
 	size_t count = size*nmemb;
-	ss->write(ptr, count);
+
+	// Returning anything short of count makes curl abort the transfer
+	if (!deliverHeaders(*transfer))
+		return 0;
+
+	transfer->reply.bodySize += count;
+	if (transfer->req.sink)
+	{
+		if (!transfer->req.sink(ptr, count))
+		{
+			transfer->aborted = true;
+			return 0;
+		}
+	}
+	else
+		transfer->reply.body.append(ptr, count);
+
 	return count;
 }
 
-static size_t headerWriter(char *ptr, size_t size, size_t nmemb, std::map<std::string,std::string> *userdata)
+static size_t headerWriter(char *ptr, size_t size, size_t nmemb, HTTPSClient::header_map *userdata)
 {
-	std::map<std::string, std::string> &headers = *userdata;
+	HTTPSClient::header_map &headers = *userdata;
 	size_t count = size*nmemb;
 	std::string line(ptr, count);
+
+	// Each response after a redirect or an interim one starts over
+	if (line.compare(0, 5, "HTTP/") == 0)
+	{
+		headers.clear();
+		return count;
+	}
+
 	size_t split = line.find(':');
 	size_t newline = line.find('\r');
 	if (newline == std::string::npos)
 		newline = line.size();
 
 	if (split != std::string::npos)
-		headers[line.substr(0, split)] = line.substr(split+1, newline-split-1);
+	{
+		// Same as the built-in parser, without the whitespace around the value
+		size_t valueStart = line.find_first_not_of(" \t", split+1);
+		size_t valueEnd = line.find_last_not_of(" \t", newline-1);
+		StringRef name(ptr, split);
+		if (valueStart == std::string::npos || valueStart >= newline)
+			headers.add(name, StringRef());
+		else
+			headers.add(name, StringRef(ptr + valueStart, valueEnd-valueStart+1));
+	}
 	return count;
 }
 
-bool CurlClient::valid() const
+CURL *CurlClient::acquireHandle()
 {
-	return curl.loaded;
+	// A nested request on the same thread gets a handle of its own
+	if (cachedHandle.inUse)
+		return curl.easy_init();
+
+	if (!cachedHandle.handle)
+	{
+		cachedHandle.handle = curl.easy_init();
+		cachedHandle.cleanup = curl.easy_cleanup;
+	}
+
+	cachedHandle.inUse = cachedHandle.handle != nullptr;
+	return cachedHandle.handle;
 }
 
-HTTPSClient::Reply CurlClient::request(const HTTPSClient::Request &req)
+void CurlClient::releaseHandle(CURL *handle)
 {
-	Reply reply;
-	reply.responseCode = 0;
+	if (handle != cachedHandle.handle)
+	{
+		curl.easy_cleanup(handle);
+		return;
+	}
 
-	// Use sensible default header for later
-	HTTPSClient::header_map newHeaders = req.headers;
+	// Resetting drops the options pointing at request state, but keeps the caches
+	curl.easy_reset(handle);
+	cachedHandle.inUse = false;
+}
 
-	CURL *handle = curl.easy_init();
-	if (!handle)
-		throw std::runtime_error("Could not create curl request");
+bool CurlClient::setCABundle(const std::string &pem)
+{
+#if LIBCURL_VERSION_NUM >= 0x074d00
+	std::shared_ptr<const std::string> bundle;
+	if (!pem.empty())
+		bundle = std::make_shared<const std::string>(pem);
+
+	std::lock_guard<std::mutex> lock(caMutex);
+	caBundle = bundle;
+	return true;
+#else
+	return pem.empty();
+#endif
+}
+
+bool CurlClient::valid() const
+{
+	return curl.load();
+}
+
+void CurlClient::prepare(CURL *handle, Transfer &transfer)
+{
+	const HTTPSClient::Request &req = transfer.req;
+
+	// Opened before anything else, so there is nothing to undo if it fails
+	if (!req.postfile.empty() && req.method != "GET" && req.method != "HEAD")
+		transfer.file.reset(new FileReader(req.postfile));
 
 	curl.easy_setopt(handle, CURLOPT_URL, req.url.c_str());
+	// Curl keeps its own DNS cache, but follows the same settings
+	curl.easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, (long) std::chrono::duration_cast<std::chrono::seconds>(Resolver::getInstance().getTTL()).count());
 	curl.easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
 	curl.easy_setopt(handle, CURLOPT_CUSTOMREQUEST, req.method.c_str());
+	// Negotiated through ALPN, servers without it and plain http stay on HTTP/1.1.
+	// Fails harmlessly if this libcurl was built without HTTP/2.
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	curl.easy_setopt(handle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+#endif
 
-	StringReader reader {};
-
-	if (req.postdata.size() > 0 && (req.method != "GET" && req.method != "HEAD"))
+	if (req.hasBody() && (req.method != "GET" && req.method != "HEAD"))
 	{
-		reader.str = &req.postdata;
-		reader.pos = 0;
 		curl.easy_setopt(handle, CURLOPT_UPLOAD, 1L);
-		curl.easy_setopt(handle, CURLOPT_READFUNCTION, stringReader);
-		curl.easy_setopt(handle, CURLOPT_READDATA, &reader);
-		curl.easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t) req.postdata.length());
+		curl.easy_setopt(handle, CURLOPT_READFUNCTION, bodyReader);
+		curl.easy_setopt(handle, CURLOPT_READDATA, &transfer);
+
+		// Without a size, curl sends the body from the source chunked
+		if (transfer.file)
+			curl.easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t) transfer.file->getSize());
+		else if (!req.source)
+			curl.easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t) req.postdata.size);
 	}
 
 	if (req.method == "HEAD")
 		curl.easy_setopt(handle, CURLOPT_NOBODY, 1L);
 
-	// Curl doesn't copy memory, keep the strings around
-	std::vector<std::string> lines;
-	for (auto &header : newHeaders)
+	// An empty string offers every encoding this libcurl was built to decode
+	if (req.decompress)
+		curl.easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+
+	if (req.timeout.count() > 0)
+		curl.easy_setopt(handle, CURLOPT_TIMEOUT_MS, (long) req.timeout.count());
+	if (req.connectTimeout.count() > 0)
+		curl.easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, (long) req.connectTimeout.count());
+	if (req.idleTimeout.count() > 0)
 	{
-		std::stringstream line;
-		line << header.first << ": " << header.second;
-		lines.push_back(line.str());
+		// Curl only knows a minimum speed, a stall of any kind is under 1 byte per second
+		curl.easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+		curl.easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, (long) ((req.idleTimeout.count() + 999) / 1000));
 	}
 
-	curl_slist *sendHeaders = nullptr;
-	for (auto &line : lines)
-		sendHeaders = curl.slist_append(sendHeaders, line.c_str());
+	// Held until the transfer is done, curl doesn't copy it
+	{
+		std::lock_guard<std::mutex> lock(caMutex);
+		transfer.bundle = caBundle;
+	}
 
-	if (sendHeaders)
-		curl.easy_setopt(handle, CURLOPT_HTTPHEADER, sendHeaders);
+#if LIBCURL_VERSION_NUM >= 0x074d00
+	if (transfer.bundle)
+	{
+		transfer.caBlob.data = (void *) transfer.bundle->data();
+		transfer.caBlob.len = transfer.bundle->size();
+		transfer.caBlob.flags = CURL_BLOB_NOCOPY;
+		curl.easy_setopt(handle, CURLOPT_CAINFO_BLOB, &transfer.caBlob);
+	}
+#endif
+
+	for (auto header : req.headers)
+	{
+		std::string line;
+		line.reserve(header.name.size + 2 + header.value.size);
+		line.append(header.name.data, header.name.size).append(": ").append(header.value.data, header.value.size);
+		transfer.lines.push_back(std::move(line));
+	}
+
+	for (auto &line : transfer.lines)
+		transfer.sendHeaders = curl.slist_append(transfer.sendHeaders, line.c_str());
 
-	std::stringstream body;
+	if (transfer.sendHeaders)
+		curl.easy_setopt(handle, CURLOPT_HTTPHEADER, transfer.sendHeaders);
 
-	curl.easy_setopt(handle, CURLOPT_WRITEFUNCTION, stringstreamWriter);
-	curl.easy_setopt(handle, CURLOPT_WRITEDATA, &body);
+	curl.easy_setopt(handle, CURLOPT_WRITEFUNCTION, bodyWriter);
+	curl.easy_setopt(handle, CURLOPT_WRITEDATA, &transfer);
 
 	curl.easy_setopt(handle, CURLOPT_HEADERFUNCTION, headerWriter);
-	curl.easy_setopt(handle, CURLOPT_HEADERDATA, &reply.headers);
+	curl.easy_setopt(handle, CURLOPT_HEADERDATA, &transfer.reply.headers);
+
+#if LIBCURL_VERSION_NUM >= 0x071507
+	curl.easy_setopt(handle, CURLOPT_CLOSESOCKETFUNCTION, closeSocket);
+#endif
+}
+
+void CurlClient::complete(CURL *handle, Transfer &transfer, CURLcode result)
+{
+	if (transfer.sendHeaders)
+	{
+		curl.slist_free_all(transfer.sendHeaders);
+		transfer.sendHeaders = nullptr;
+	}
 
-	curl.easy_perform(handle);
+	long responseCode;
+	curl.easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &responseCode);
 
-	if (sendHeaders)
-		curl.slist_free_all(sendHeaders);
+	// Responses without a body never reached the writer
+	if (!transfer.headersDelivered && responseCode != 0)
+		deliverHeaders(transfer);
 
+	// Counts the body as it came over the wire, before any decoding
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_off_t rawBodySize = 0;
+	curl.easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &rawBodySize);
+#else
+	double rawBodySize = 0;
+	curl.easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &rawBodySize);
+#endif
+	transfer.reply.rawBodySize = (uint64_t) rawBodySize;
+
+	collectTimings(handle, transfer.reply.timings);
+
+	long connects = 0;
+	curl.easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+	Stats::add(Stats::CONNECTIONS_OPENED, (uint64_t) connects);
+	if (transfer.reply.timings.reused)
+		Stats::add(Stats::CONNECTIONS_REUSED);
+	// Curl doesn't say whether it resumed a session, its handshakes all count as full
+	if (connects > 0 && transfer.reply.timings.tlsHandshake > 0.0)
+		Stats::add(Stats::TLS_FULL, (uint64_t) connects);
+
+	transfer.timedOut = result == CURLE_OPERATION_TIMEDOUT;
+
+	// Without a response it's a plain connection failure, like the other backends report it
+	if (result != CURLE_OK && !transfer.aborted && responseCode != 0)
+		transfer.reply.error = curl.easy_strerror(result);
+}
+
+void CurlClient::collectTimings(CURL *handle, Timings &timings)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+	auto seconds = [handle](CURLINFO info) {
+		curl_off_t microseconds = 0;
+		curl.easy_getinfo(handle, info, &microseconds);
+		return microseconds / 1e6;
+	};
+
+	timings.nameLookup = seconds(CURLINFO_NAMELOOKUP_TIME_T);
+	timings.connect = seconds(CURLINFO_CONNECT_TIME_T);
+	timings.tlsHandshake = seconds(CURLINFO_APPCONNECT_TIME_T);
+	timings.firstByte = seconds(CURLINFO_STARTTRANSFER_TIME_T);
+	timings.total = seconds(CURLINFO_TOTAL_TIME_T);
+
+	curl_off_t uploaded = 0, downloaded = 0;
+	curl.easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+	curl.easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+#else
+	auto seconds = [handle](CURLINFO info) {
+		double value = 0.0;
+		curl.easy_getinfo(handle, info, &value);
+		return value;
+	};
+
+	timings.nameLookup = seconds(CURLINFO_NAMELOOKUP_TIME);
+	timings.connect = seconds(CURLINFO_CONNECT_TIME);
+	timings.tlsHandshake = seconds(CURLINFO_APPCONNECT_TIME);
+	timings.firstByte = seconds(CURLINFO_STARTTRANSFER_TIME);
+	timings.total = seconds(CURLINFO_TOTAL_TIME);
+
+	double uploaded = 0.0, downloaded = 0.0;
+	curl.easy_getinfo(handle, CURLINFO_SIZE_UPLOAD, &uploaded);
+	curl.easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &downloaded);
+#endif
+
+	// Header sizes cover every response and request, redirects included
+	long requestSize = 0, headerSize = 0, connects = 0;
+	curl.easy_getinfo(handle, CURLINFO_REQUEST_SIZE, &requestSize);
+	curl.easy_getinfo(handle, CURLINFO_HEADER_SIZE, &headerSize);
+	curl.easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+
+	timings.bytesSent = (uint64_t) requestSize + (uint64_t) uploaded;
+	timings.bytesReceived = (uint64_t) headerSize + (uint64_t) downloaded;
+	timings.reused = connects == 0 && headerSize > 0;
+}
+
+HTTPSClient::Reply CurlClient::request(const HTTPSClient::Request &req)
+{
+	CURL *handle = acquireHandle();
+	if (!handle)
+		throw std::runtime_error("Could not create curl request");
+
+	Transfer transfer(handle, req);
+
+	try
+	{
+		prepare(handle, transfer);
+	}
+	catch (...)
+	{
+		releaseHandle(handle);
+		throw;
+	}
+
+	CURLcode result = curl.easy_perform(handle);
+
+	complete(handle, transfer, result);
+	releaseHandle(handle);
+
+	if (transfer.timedOut)
+		throw HTTPSClient::TimeoutError();
+
+	return std::move(transfer.reply);
+}
+
+bool CurlClient::submit(const std::shared_ptr<AsyncRequest> &async)
+{
+	if (!multi.available())
+		return false;
+
+	multi.submit(async);
+	return true;
+}
+
+CurlClient::MultiEngine::MultiEngine()
+	: multi(nullptr)
+	, stopping(false)
+	, inFlight(0)
+{
+}
+
+CurlClient::MultiEngine::~MultiEngine()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	if (thread.joinable())
+	{
+		curl.multi_wakeup(multi);
+		thread.join();
+	}
+
+	for (CURL *handle : idleHandles)
+		curl.easy_cleanup(handle);
+
+	if (multi)
+		curl.multi_cleanup(multi);
+}
+
+bool CurlClient::MultiEngine::available() const
+{
+	return curl.load() && curl.multiLoaded;
+}
+
+void CurlClient::MultiEngine::submit(const std::shared_ptr<AsyncRequest> &async)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (stopping)
+			throw std::runtime_error("Shutting down");
+		if (inFlight >= maxTransfers)
+			throw std::runtime_error("Too many asynchronous requests in flight");
+
+		// The thread is started on first use
+		if (!multi)
+		{
+			multi = curl.multi_init();
+			if (!multi)
+				throw std::runtime_error("Could not create curl multi handle");
+
+#if LIBCURL_VERSION_NUM >= 0x072b00
+			// Transfers to the same origin share one HTTP/2 connection
+			curl.multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+			thread = std::thread(&MultiEngine::run, this);
+		}
+
+		submitted.push_back(async);
+		inFlight++;
+	}
+
+	curl.multi_wakeup(multi);
+}
+
+void CurlClient::MultiEngine::run()
+{
+	std::vector<std::shared_ptr<AsyncRequest>> starting;
+
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+				break;
+
+			starting.swap(submitted);
+		}
+
+		for (auto &async : starting)
+			start(async);
+		starting.clear();
+
+		int running = 0;
+		curl.multi_perform(multi, &running);
+
+		int remaining = 0;
+		while (CURLMsg *message = curl.multi_info_read(multi, &remaining))
+		{
+			if (message->msg == CURLMSG_DONE)
+				finish(message->easy_handle, message->data.result);
+		}
+
+		// Sleeps until there is socket activity, a timeout or a new submission
+		curl.multi_poll(multi, nullptr, 0, 1000, nullptr);
+	}
+
+	// Whatever is still running or queued when shutting down fails, so
+	// nobody waits for it forever
+	std::vector<std::shared_ptr<AsyncRequest>> abandoned;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		abandoned.swap(submitted);
+		inFlight = 0;
+	}
+
+	for (CURL *handle : activeHandles)
+	{
+		Transfer *transfer = nullptr;
+		curl.easy_getinfo(handle, CURLINFO_PRIVATE, &transfer);
+		curl.multi_remove_handle(multi, handle);
+
+		if (transfer->sendHeaders)
+			curl.slist_free_all(transfer->sendHeaders);
+		abandoned.push_back(transfer->async);
+		delete transfer;
+
+		curl.easy_cleanup(handle);
+	}
+	activeHandles.clear();
+
+	for (auto &async : abandoned)
+		async->fail("Shutting down");
+}
+
+void CurlClient::MultiEngine::start(const std::shared_ptr<AsyncRequest> &async)
+{
+	CURL *handle = nullptr;
+	if (!idleHandles.empty())
 	{
-		long responseCode;
-		curl.easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &responseCode);
-		reply.responseCode = (int) responseCode;
+		handle = idleHandles.back();
+		idleHandles.pop_back();
 	}
+	else
+		handle = curl.easy_init();
+
+	std::unique_ptr<Transfer> transfer;
+	std::string error = "Could not create curl request";
 
-	reply.body = body.str();
+	if (handle)
+	{
+		transfer.reset(new Transfer(handle, async->getRequest()));
+		transfer->async = async;
+
+		try
+		{
+			prepare(handle, *transfer);
+		}
+		catch (const std::exception &e)
+		{
+			// Nothing was set on the handle yet
+			idleHandles.push_back(handle);
+			transfer.reset();
+			error = e.what();
+		}
+	}
+
+	if (!transfer)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			inFlight--;
+		}
 
-	curl.easy_cleanup(handle);
-	return reply;
+		async->fail(error);
+		return;
+	}
+
+	// Rather than opening a connection of its own, wait for one being set up
+	// to the same origin, in case it turns out to be HTTP/2
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	curl.easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+#endif
+	curl.easy_setopt(handle, CURLOPT_PRIVATE, transfer.get());
+	curl.multi_add_handle(multi, handle);
+	activeHandles.push_back(handle);
+	transfer.release();
 }
 
+void CurlClient::MultiEngine::finish(CURL *handle, CURLcode result)
+{
+	Transfer *transfer = nullptr;
+	curl.easy_getinfo(handle, CURLINFO_PRIVATE, &transfer);
+	curl.multi_remove_handle(multi, handle);
+	activeHandles.erase(std::find(activeHandles.begin(), activeHandles.end(), handle));
+
+	complete(handle, *transfer, result);
+
+	// Handles stay with the engine, the connections live in the multi handle
+	curl.easy_reset(handle);
+	idleHandles.push_back(handle);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		inFlight--;
+	}
+
+	// Transfers on the event loop never pass through request(), so they are counted here
+	if (transfer->timedOut)
+	{
+		Stats::add(Stats::ERRORS_TIMEOUT);
+		transfer->async->fail(HTTPSClient::TimeoutError().what());
+	}
+	else
+	{
+		Stats::recordReply(transfer->req.url, transfer->reply, transfer->reply.timings.total);
+		transfer->async->complete(std::move(transfer->reply));
+	}
+	delete transfer;
+}
+
+std::mutex CurlClient::caMutex;
+std::shared_ptr<const std::string> CurlClient::caBundle;
+
 CurlClient::Curl CurlClient::curl;
+CurlClient::MultiEngine CurlClient::multi;
 
 #endif // HTTPS_BACKEND_CURL
@@ -4,6 +4,12 @@
 
 #ifdef HTTPS_BACKEND_CURL
 
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <curl/curl.h>
 
 #include "../common/HTTPSClient.h"
@@ -14,12 +20,69 @@ class CurlClient : public HTTPSClient
 public:
 	virtual bool valid() const override;
 	virtual HTTPSClient::Reply request(const HTTPSClient::Request &req) override;
+	virtual bool submit(const std::shared_ptr<AsyncRequest> &async) override;
+
+	// Verifies peers against the certificates in a PEM bundle, an empty bundle
+	// switches back to the default store. Requires libcurl 7.77.0 or newer.
+	static bool setCABundle(const std::string &pem);
 
 private:
+	struct Transfer;
+
+	// Drives any number of transfers from a single thread through curl_multi,
+	// so they share one connection cache instead of needing a thread each
+	class MultiEngine
+	{
+	public:
+		MultiEngine();
+		~MultiEngine();
+
+		bool available() const;
+		void submit(const std::shared_ptr<AsyncRequest> &async);
+
+	private:
+		void run();
+		void start(const std::shared_ptr<AsyncRequest> &async);
+		void finish(CURL *handle, CURLcode result);
+
+		static const size_t maxTransfers = 1024;
+
+		CURLM *multi;
+		std::thread thread;
+
+		std::mutex mutex;
+		bool stopping;
+		size_t inFlight;
+		std::vector<std::shared_ptr<AsyncRequest>> submitted;
+		// Reset handles waiting for their next transfer
+		std::vector<CURL *> idleHandles;
+		// Handles in the multi handle, only touched by the engine's thread
+		std::vector<CURL *> activeHandles;
+	};
+
+	static void prepare(CURL *handle, Transfer &transfer);
+	static void complete(CURL *handle, Transfer &transfer, CURLcode result);
+	static bool deliverHeaders(Transfer &transfer);
+	static void collectTimings(CURL *handle, Timings &timings);
+	static size_t bodyWriter(char *ptr, size_t size, size_t nmemb, Transfer *transfer);
+	static size_t bodyReader(char *ptr, size_t size, size_t nmemb, Transfer *transfer);
+
+	static CURL *acquireHandle();
+	static void releaseHandle(CURL *handle);
+
+	static std::mutex caMutex;
+	static std::shared_ptr<const std::string> caBundle;
+
+	// Loaded and initialized on first use, most programs that load the module
+	// never make a request
 	static struct Curl
 	{
 		Curl();
 		~Curl();
+		// Returns whether the library could be loaded, only the first call loads it
+		bool load();
+
+		std::once_flag loadFlag;
 		LibraryLoader::handle *handle;
 		bool loaded;
 
@@ -27,13 +90,33 @@ private:
 
 		decltype(&curl_easy_init) easy_init;
 		decltype(&curl_easy_cleanup) easy_cleanup;
+		decltype(&curl_easy_reset) easy_reset;
 		decltype(&curl_easy_setopt) easy_setopt;
 		decltype(&curl_easy_perform) easy_perform;
 		decltype(&curl_easy_getinfo) easy_getinfo;
+		decltype(&curl_easy_strerror) easy_strerror;
 
 		decltype(&curl_slist_append) slist_append;
 		decltype(&curl_slist_free_all) slist_free_all;
+
+		// Optional, the multi interface needs curl_multi_poll and curl_multi_wakeup from 7.68.0
+		bool multiLoaded;
+		decltype(&curl_multi_init) multi_init;
+		decltype(&curl_multi_cleanup) multi_cleanup;
+		decltype(&curl_multi_add_handle) multi_add_handle;
+		decltype(&curl_multi_remove_handle) multi_remove_handle;
+		decltype(&curl_multi_perform) multi_perform;
+		decltype(&curl_multi_info_read) multi_info_read;
+		decltype(&curl_multi_setopt) multi_setopt;
+		CURLMcode (*multi_poll)(CURLM *multi, curl_waitfd extra[], unsigned int extraCount, int timeout, int *ret);
+		CURLMcode (*multi_wakeup)(CURLM *multi);
+
+	private:
+		void open();
 	} curl;
+
+	// Defined after curl, so the engine is torn down before the library is unloaded
+	static MultiEngine multi;
 };
 
 #endif // HTTPS_BACKEND_CURL
@@ -48,11 +48,22 @@ namespace LibraryLoader
 			RETURN_MATCHING_FUNCTION(curl_global_cleanup);
 			RETURN_MATCHING_FUNCTION(curl_easy_init);
 			RETURN_MATCHING_FUNCTION(curl_easy_cleanup);
+			RETURN_MATCHING_FUNCTION(curl_easy_reset);
 			RETURN_MATCHING_FUNCTION(curl_easy_setopt);
 			RETURN_MATCHING_FUNCTION(curl_easy_perform);
 			RETURN_MATCHING_FUNCTION(curl_easy_getinfo);
+			RETURN_MATCHING_FUNCTION(curl_easy_strerror);
 			RETURN_MATCHING_FUNCTION(curl_slist_append);
 			RETURN_MATCHING_FUNCTION(curl_slist_free_all);
+			RETURN_MATCHING_FUNCTION(curl_multi_init);
+			RETURN_MATCHING_FUNCTION(curl_multi_cleanup);
+			RETURN_MATCHING_FUNCTION(curl_multi_add_handle);
+			RETURN_MATCHING_FUNCTION(curl_multi_remove_handle);
+			RETURN_MATCHING_FUNCTION(curl_multi_perform);
+			RETURN_MATCHING_FUNCTION(curl_multi_info_read);
+			RETURN_MATCHING_FUNCTION(curl_multi_setopt);
+			RETURN_MATCHING_FUNCTION(curl_multi_poll);
+			RETURN_MATCHING_FUNCTION(curl_multi_wakeup);
 		}
 #endif
 
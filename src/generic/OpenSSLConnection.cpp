@@ -2,10 +2,19 @@
 
 #ifdef HTTPS_BACKEND_OPENSSL
 
+#include <algorithm>
+#include <cctype>
+
 #include "../common/LibraryLoader.h"
+#include "../common/SigpipeGuard.h"
+#include "../common/Stats.h"
 
 // Not present in openssl 1.1 headers
 #define SSL_CTRL_OPTIONS 32
+// Only used with openssl 1.0, whose SSL_session_reused is a macro around it
+#ifndef SSL_CTRL_GET_SESSION_REUSED
+#	define SSL_CTRL_GET_SESSION_REUSED 8
+#endif
 
 static bool TryOpenLibraries(const char *sslName, LibraryLoader::handle *& sslHandle, const char *cryptoName, LibraryLoader::handle *&cryptoHandle)
 {
@@ -22,7 +31,13 @@ static bool TryOpenLibraries(const char *sslName, LibraryLoader::handle *& sslHa
 	return false;
 }
 
-OpenSSLConnection::SSLFuncs::SSLFuncs()
+bool OpenSSLConnection::SSLFuncs::load()
+{
+	std::call_once(loadFlag, [this]() { open(); });
+	return valid;
+}
+
+void OpenSSLConnection::SSLFuncs::open()
 {
 	using namespace LibraryLoader;
 
@@ -49,6 +64,7 @@ OpenSSLConnection::SSLFuncs::SSLFuncs()
 	valid = valid && LoadSymbol(CTX_set_verify, sslhandle, "SSL_CTX_set_verify");
 	valid = valid && LoadSymbol(CTX_set_default_verify_paths, sslhandle, "SSL_CTX_set_default_verify_paths");
 	valid = valid && LoadSymbol(CTX_free, sslhandle, "SSL_CTX_free");
+	LoadSymbol(CTX_set_cert_store, sslhandle, "SSL_CTX_set_cert_store");
 
 	valid = valid && LoadSymbol(SSL_new, sslhandle, "SSL_new");
 	valid = valid && LoadSymbol(SSL_free, sslhandle, "SSL_free");
@@ -57,6 +73,19 @@ OpenSSLConnection::SSLFuncs::SSLFuncs()
 	valid = valid && LoadSymbol(read, sslhandle, "SSL_read");
 	valid = valid && LoadSymbol(write, sslhandle, "SSL_write");
 	valid = valid && LoadSymbol(shutdown, sslhandle, "SSL_shutdown");
+	valid = valid && LoadSymbol(pending, sslhandle, "SSL_pending");
+	valid = valid && LoadSymbol(get_error, sslhandle, "SSL_get_error");
+	valid = valid && LoadSymbol(SSL_ctrl, sslhandle, "SSL_ctrl");
+
+	// Session resumption is optional, ticket lifetimes need 1.1.0 and is_resumable 1.1.1
+	LoadSymbol(set_session, sslhandle, "SSL_set_session");
+	LoadSymbol(get1_session, sslhandle, "SSL_get1_session");
+	LoadSymbol(session_reused, sslhandle, "SSL_session_reused");
+	LoadSymbol(SESSION_free, sslhandle, "SSL_SESSION_free");
+	LoadSymbol(SESSION_dup, sslhandle, "SSL_SESSION_dup");
+	LoadSymbol(SESSION_is_resumable, sslhandle, "SSL_SESSION_is_resumable");
+	LoadSymbol(SESSION_get_ticket_lifetime_hint, sslhandle, "SSL_SESSION_get_ticket_lifetime_hint");
+	LoadSymbol(SESSION_get_timeout, sslhandle, "SSL_SESSION_get_timeout");
 	valid = valid && LoadSymbol(get_verify_result, sslhandle, "SSL_get_verify_result");
 	valid = valid && (LoadSymbol(get_peer_certificate, sslhandle, "SSL_get1_peer_certificate") ||
 			LoadSymbol(get_peer_certificate, sslhandle, "SSL_get_peer_certificate"));
@@ -69,6 +98,15 @@ OpenSSLConnection::SSLFuncs::SSLFuncs()
 	valid = valid && LoadSymbol(check_host, cryptohandle, "X509_check_host");
 	valid = valid && LoadSymbol(X509_free, cryptohandle, "X509_free");
 
+	// Only needed for in-memory CA bundles
+	LoadSymbol(BIO_new_mem_buf, cryptohandle, "BIO_new_mem_buf");
+	LoadSymbol(BIO_free, cryptohandle, "BIO_free");
+	LoadSymbol(PEM_read_bio_X509, cryptohandle, "PEM_read_bio_X509");
+	LoadSymbol(X509_STORE_new, cryptohandle, "X509_STORE_new");
+	LoadSymbol(X509_STORE_add_cert, cryptohandle, "X509_STORE_add_cert");
+	LoadSymbol(X509_STORE_free, cryptohandle, "X509_STORE_free");
+	LoadSymbol(ERR_clear_error, cryptohandle, "ERR_clear_error");
+
 	if (library_init)
 		library_init();
 	else if(init_ssl)
@@ -78,42 +116,275 @@ OpenSSLConnection::SSLFuncs::SSLFuncs()
 
 bool OpenSSLConnection::valid()
 {
-	return ssl.valid;
+	return ssl.load();
 }
 
-OpenSSLConnection::OpenSSLConnection()
-	: conn(nullptr)
+SSL_CTX *OpenSSLConnection::createContext(const std::string &pem)
 {
-	context = ssl.CTX_new(ssl.SSLv23_method());
+	X509_STORE *store = nullptr;
+
+	if (!pem.empty())
+	{
+		if (!ssl.CTX_set_cert_store || !ssl.BIO_new_mem_buf || !ssl.BIO_free || !ssl.PEM_read_bio_X509 ||
+			!ssl.X509_STORE_new || !ssl.X509_STORE_add_cert || !ssl.X509_STORE_free || !ssl.ERR_clear_error)
+			return nullptr;
+
+		store = ssl.X509_STORE_new();
+		BIO *bio = ssl.BIO_new_mem_buf(pem.data(), (int) pem.size());
+		size_t count = 0;
+
+		if (store && bio)
+		{
+			while (X509 *cert = ssl.PEM_read_bio_X509(bio, nullptr, nullptr, nullptr))
+			{
+				if (ssl.X509_STORE_add_cert(store, cert) == 1)
+					count++;
+				ssl.X509_free(cert);
+			}
+		}
+
+		// Reading past the last certificate leaves an error behind
+		ssl.ERR_clear_error();
+
+		if (bio)
+			ssl.BIO_free(bio);
+
+		if (count == 0)
+		{
+			if (store)
+				ssl.X509_STORE_free(store);
+			return nullptr;
+		}
+	}
+
+	SSL_CTX *context = ssl.CTX_new(ssl.SSLv23_method());
 	if (!context)
-		return;
+	{
+		if (store)
+			ssl.X509_STORE_free(store);
+		return nullptr;
+	}
 
 	if (ssl.CTX_set_options)
 		ssl.CTX_set_options(context, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
 	else
 		ssl.CTX_ctrl(context, SSL_CTRL_OPTIONS, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3, nullptr);
 	ssl.CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
-	ssl.CTX_set_default_verify_paths(context);
+
+	// The context takes ownership of the store
+	if (store)
+		ssl.CTX_set_cert_store(context, store);
+	else
+		ssl.CTX_set_default_verify_paths(context);
+
+	return context;
+}
+
+SSL *OpenSSLConnection::newSSL()
+{
+	std::lock_guard<std::mutex> lock(contextMutex);
+
+	// Loading the CA store is expensive, so all connections share one context.
+	// SSL_new takes a reference, which keeps it alive if it gets replaced.
+	if (!sharedContext)
+		sharedContext = createContext(caBundle);
+
+	if (!sharedContext)
+		return nullptr;
+
+	return ssl.SSL_new(sharedContext);
+}
+
+void OpenSSLConnection::setCABundle(const std::string &pem)
+{
+	std::lock_guard<std::mutex> lock(contextMutex);
+
+	// The next connection builds a context with it, so libssl isn't loaded
+	// just for this
+	if (sharedContext)
+		ssl.CTX_free(sharedContext);
+
+	sharedContext = nullptr;
+	caBundle = pem;
+
+	// A resumed session skips certificate verification, so sessions
+	// established under the old trust settings must go
+	clearSessions();
+}
+
+SSL_SESSION *OpenSSLConnection::takeSession(const std::string &key)
+{
+	std::lock_guard<std::mutex> lock(sessionMutex);
+
+	auto it = sessions.find(key);
+	if (it == sessions.end())
+		return nullptr;
+
+	// Sessions are single use, the connection stores a fresh one once it has it
+	SSL_SESSION *session = it->second.session;
+	bool expired = std::chrono::steady_clock::now() >= it->second.expires;
+	sessions.erase(it);
+
+	if (expired)
+	{
+		ssl.SESSION_free(session);
+		return nullptr;
+	}
+
+	return session;
+}
+
+void OpenSSLConnection::storeSession(const std::string &key, SSL_SESSION *session)
+{
+	using namespace std::chrono;
+
+	// Servers announce how long they accept a ticket, use the session timeout otherwise
+	long lifetime = 0;
+	if (ssl.SESSION_get_ticket_lifetime_hint)
+		lifetime = (long) ssl.SESSION_get_ticket_lifetime_hint(session);
+	if (lifetime <= 0 && ssl.SESSION_get_timeout)
+		lifetime = ssl.SESSION_get_timeout(session);
+	if (lifetime <= 0)
+		lifetime = 300;
+
+	// TLS 1.3 never allows more than 7 days
+	lifetime = std::min(lifetime, 7L * 24 * 60 * 60);
+
+	CachedSession entry;
+	entry.session = session;
+	entry.stored = steady_clock::now();
+	entry.expires = entry.stored + seconds(lifetime);
+
+	std::lock_guard<std::mutex> lock(sessionMutex);
+
+	auto it = sessions.find(key);
+	if (it != sessions.end())
+	{
+		ssl.SESSION_free(it->second.session);
+		it->second = entry;
+		return;
+	}
+
+	if (sessions.size() >= maxCachedSessions)
+	{
+		// Evict whatever expired, or failing that the oldest entry
+		auto evict = sessions.begin();
+		for (auto it = sessions.begin(); it != sessions.end(); ++it)
+		{
+			if (it->second.expires <= entry.stored)
+			{
+				evict = it;
+				break;
+			}
+
+			if (it->second.stored < evict->second.stored)
+				evict = it;
+		}
+
+		ssl.SESSION_free(evict->second.session);
+		sessions.erase(evict);
+	}
+
+	sessions[key] = entry;
+}
+
+void OpenSSLConnection::clearSessions()
+{
+	std::lock_guard<std::mutex> lock(sessionMutex);
+
+	for (auto &entry : sessions)
+		ssl.SESSION_free(entry.second.session);
+
+	sessions.clear();
+}
+
+void OpenSSLConnection::saveSession()
+{
+	if (sessionKey.empty() || !ssl.get1_session || !ssl.SESSION_free)
+		return;
+
+	SSL_SESSION *session = ssl.get1_session(conn);
+	if (!session)
+		return;
+
+	// The connection keeps using its session, and marks it as not resumable if
+	// it later ends with an error. Cache a snapshot that isn't affected by that.
+	if (ssl.SESSION_dup)
+	{
+		SSL_SESSION *copy = ssl.SESSION_dup(session);
+		ssl.SESSION_free(session);
+		session = copy;
+		if (!session)
+			return;
+	}
+
+	if (ssl.SESSION_is_resumable && !ssl.SESSION_is_resumable(session))
+	{
+		ssl.SESSION_free(session);
+		return;
+	}
+
+	storeSession(sessionKey, session);
+	sessionSaved = true;
+}
+
+static bool isIPAddress(const std::string &hostname)
+{
+	// IPv6 literals contain colons, IPv4 ones only digits and dots
+	if (hostname.find(':') != std::string::npos)
+		return true;
+
+	for (char c : hostname)
+		if (c != '.' && !std::isdigit((unsigned char) c))
+			return false;
+
+	return true;
+}
+
+OpenSSLConnection::OpenSSLConnection()
+	: conn(nullptr)
+	, sessionSaved(false)
+	, lastReadFailed(false)
+{
 }
 
 OpenSSLConnection::~OpenSSLConnection()
 {
 	if (conn)
 		ssl.SSL_free(conn);
+}
+
+template<typename Operation>
+int OpenSSLConnection::retry(Operation operation)
+{
+	while (true)
+	{
+		int result = operation();
+		if (result > 0)
+			return result;
 
-	if (context)
-		ssl.CTX_free(context);
+		int error = ssl.get_error(conn, result);
+		if (error == SSL_ERROR_WANT_READ)
+		{
+			if (!socket.wait(false))
+				return -1;
+		}
+		else if (error == SSL_ERROR_WANT_WRITE)
+		{
+			if (!socket.wait(true))
+				return -1;
+		}
+		else
+			return result;
+	}
 }
 
 bool OpenSSLConnection::connect(const std::string &hostname, uint16_t port)
 {
-	if (!context)
-		return false;
-
 	if (!socket.connect(hostname, port))
 		return false;
 
-	conn = ssl.SSL_new(context);
+	conn = newSSL();
 	if (!conn)
 	{
 		socket.close();
@@ -121,7 +392,31 @@ bool OpenSSLConnection::connect(const std::string &hostname, uint16_t port)
 	}
 
 	ssl.set_fd(conn, socket.getFd());
-	if (ssl.connect(conn) != 1 || ssl.get_verify_result(conn) != X509_V_OK)
+
+	// Servers need the name to pick a certificate and to accept a resumed session
+	if (!isIPAddress(hostname))
+		ssl.SSL_ctrl(conn, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, (void *) hostname.c_str());
+
+	std::string key = hostname + ":" + std::to_string(port);
+	if (ssl.set_session && ssl.get1_session && ssl.SESSION_free)
+	{
+		SSL_SESSION *session = takeSession(key);
+		if (session)
+		{
+			// The connection takes its own reference
+			ssl.set_session(conn, session);
+			ssl.SESSION_free(session);
+		}
+	}
+
+	// OpenSSL writes to the socket itself, without MSG_NOSIGNAL
+	bool connected;
+	{
+		SigpipeGuard guard;
+		connected = retry([this]() { return ssl.connect(conn); }) == 1;
+	}
+
+	if (!connected || ssl.get_verify_result(conn) != X509_V_OK)
 	{
 		socket.close();
 		return false;
@@ -135,25 +430,84 @@ bool OpenSSLConnection::connect(const std::string &hostname, uint16_t port)
 	}
 	ssl.X509_free(cert);
 
+	bool resumed = ssl.session_reused ? ssl.session_reused(conn) == 1 : ssl.SSL_ctrl(conn, SSL_CTRL_GET_SESSION_REUSED, 0, nullptr) == 1;
+	Stats::add(resumed ? Stats::TLS_RESUMED : Stats::TLS_FULL);
+
+	sessionKey = key;
+	secured = clock::now();
 	return true;
 }
 
 size_t OpenSSLConnection::read(char *buffer, size_t size)
 {
-	return ssl.read(conn, buffer, (int) size);
+	// Reads can write too, to answer a key update
+	SigpipeGuard guard;
+	int read = retry([&]() { return ssl.read(conn, buffer, (int) size); });
+	// Errors come back negative, as does a close without close_notify from OpenSSL 3 on
+	lastReadFailed = read < 0;
+
+	// TLS 1.3 tickets arrive after the handshake, by the first response bytes we have them
+	if (read > 0 && !sessionSaved)
+		saveSession();
+
+	return read > 0 ? (size_t) read : 0;
 }
 
 size_t OpenSSLConnection::write(const char *buffer, size_t size)
 {
-	return ssl.write(conn, buffer, (int) size);
+	SigpipeGuard guard;
+	int written = retry([&]() { return ssl.write(conn, buffer, (int) size); });
+	return written > 0 ? (size_t) written : 0;
 }
 
 void OpenSSLConnection::close()
 {
-	ssl.shutdown(conn);
+	saveSession();
+
+	// The close_notify goes to a peer that may well have gone already
+	{
+		SigpipeGuard guard;
+		ssl.shutdown(conn);
+	}
+
 	socket.close();
 }
 
+bool OpenSSLConnection::readFailed() const
+{
+	return lastReadFailed;
+}
+
+void OpenSSLConnection::setTimeouts(clock::time_point deadline, std::chrono::milliseconds idle)
+{
+	socket.setTimeouts(deadline, idle);
+}
+
+bool OpenSSLConnection::timedOut() const
+{
+	return socket.timedOut();
+}
+
+bool OpenSSLConnection::isAlive()
+{
+	// Buffered records mean the server sent something we never asked for
+	return conn && ssl.pending(conn) == 0 && socket.isAlive();
+}
+
+Connection::ConnectTimes OpenSSLConnection::getConnectTimes() const
+{
+	ConnectTimes times = socket.getConnectTimes();
+	times.secured = secured;
+	return times;
+}
+
+std::mutex OpenSSLConnection::contextMutex;
+SSL_CTX *OpenSSLConnection::sharedContext = nullptr;
+std::string OpenSSLConnection::caBundle;
+
+std::mutex OpenSSLConnection::sessionMutex;
+std::map<std::string, OpenSSLConnection::CachedSession> OpenSSLConnection::sessions;
+
 OpenSSLConnection::SSLFuncs OpenSSLConnection::ssl;
 
 #endif // HTTPS_BACKEND_OPENSSL
@@ -4,6 +4,11 @@
 
 #ifdef HTTPS_BACKEND_OPENSSL
 
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
 #include <openssl/ssl.h>
 
 #include "../common/Connection.h"
@@ -17,18 +22,67 @@ public:
 	virtual size_t read(char *buffer, size_t size) override;
 	virtual size_t write(const char *buffer, size_t size) override;
 	virtual void close() override;
+	virtual bool readFailed() const override;
+	virtual void setTimeouts(clock::time_point deadline, std::chrono::milliseconds idle) override;
+	virtual bool timedOut() const override;
+	virtual bool isAlive() override;
+	virtual ConnectTimes getConnectTimes() const override;
 	virtual ~OpenSSLConnection();
 
 	static bool valid();
+	// Verifies peers against the certificates in a PEM bundle instead of the
+	// system store. An empty bundle switches back to the system store. It is
+	// only parsed when the next connection needs it.
+	static void setCABundle(const std::string &pem);
 
 private:
 	PlaintextConnection socket;
-	SSL_CTX *context;
 	SSL *conn;
+	// Only set once the peer is verified, sessions are never cached before that
+	std::string sessionKey;
+	bool sessionSaved;
+	bool lastReadFailed;
+	clock::time_point secured;
+
+	void saveSession();
+
+	// Repeats an operation on the non-blocking socket until OpenSSL stops
+	// asking for more to read or write, returns its final result
+	template<typename Operation>
+	int retry(Operation operation);
+
+	static SSL_CTX *createContext(const std::string &pem);
+	static SSL *newSSL();
+
+	static std::mutex contextMutex;
+	static SSL_CTX *sharedContext;
+	static std::string caBundle;
+
+	// Client side session cache so reconnects can do an abbreviated handshake
+	struct CachedSession
+	{
+		SSL_SESSION *session;
+		std::chrono::steady_clock::time_point stored;
+		std::chrono::steady_clock::time_point expires;
+	};
 
+	static const size_t maxCachedSessions = 64;
+
+	static SSL_SESSION *takeSession(const std::string &key);
+	static void storeSession(const std::string &key, SSL_SESSION *session);
+	static void clearSessions();
+
+	static std::mutex sessionMutex;
+	static std::map<std::string, CachedSession> sessions;
+
+	// Loaded and initialized on first use, most programs that load the module
+	// never make a request
 	struct SSLFuncs
 	{
-		SSLFuncs();
+		// Returns whether the libraries could be loaded, only the first call loads them
+		bool load();
+
+		std::once_flag loadFlag;
 		bool valid;
 
 		int (*library_init)();
@@ -40,6 +94,7 @@ private:
 		void (*CTX_set_verify)(SSL_CTX *ctx, int mode, void *verify_callback);
 		int (*CTX_set_default_verify_paths)(SSL_CTX *ctx);
 		void (*CTX_free)(SSL_CTX *ctx);
+		void (*CTX_set_cert_store)(SSL_CTX *ctx, X509_STORE *store);
 
 		SSL *(*SSL_new)(SSL_CTX *ctx);
 		void (*SSL_free)(SSL *ctx);
@@ -48,6 +103,18 @@ private:
 		int (*read)(SSL *ssl, void *buf, int num);
 		int (*write)(SSL *ssl, const void *buf, int num);
 		int (*shutdown)(SSL *ssl);
+		int (*pending)(const SSL *ssl);
+		int (*get_error)(const SSL *ssl, int ret);
+		long (*SSL_ctrl)(SSL *ssl, int cmd, long larg, void *parg);
+
+		int (*set_session)(SSL *ssl, SSL_SESSION *session);
+		SSL_SESSION *(*get1_session)(SSL *ssl);
+		int (*session_reused)(const SSL *ssl);
+		void (*SESSION_free)(SSL_SESSION *session);
+		SSL_SESSION *(*SESSION_dup)(const SSL_SESSION *session);
+		int (*SESSION_is_resumable)(const SSL_SESSION *session);
+		unsigned long (*SESSION_get_ticket_lifetime_hint)(const SSL_SESSION *session);
+		long (*SESSION_get_timeout)(const SSL_SESSION *session);
 		long (*get_verify_result)(const SSL *ssl);
 		X509 *(*get_peer_certificate)(const SSL *ssl);
 
@@ -55,6 +122,17 @@ private:
 
 		int (*check_host)(X509 *cert, const char *name, size_t namelen, unsigned int flags, char **peername);
 		void (*X509_free)(X509* cert);
+
+		BIO *(*BIO_new_mem_buf)(const void *buf, int len);
+		int (*BIO_free)(BIO *bio);
+		X509 *(*PEM_read_bio_X509)(BIO *bio, X509 **cert, void *callback, void *userdata);
+		X509_STORE *(*X509_STORE_new)();
+		int (*X509_STORE_add_cert)(X509_STORE *store, X509 *cert);
+		void (*X509_STORE_free)(X509_STORE *store);
+		void (*ERR_clear_error)();
+
+	private:
+		void open();
 	};
 	static SSLFuncs ssl;
 };
@@ -1,5 +1,10 @@
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <new>
 #include <set>
+#include <vector>
 
 extern "C"
 {
@@ -8,8 +13,20 @@ extern "C"
 }
 
 #include "../common/HTTPS.h"
+#include "../common/AsyncRequest.h"
 #include "../common/config.h"
 
+// How a reply is handed back to Lua
+struct ReplyFormat
+{
+	// Headers are only returned when options were given
+	bool advanced = false;
+	// The body as a Buffer instead of a string
+	bool buffer = false;
+	// A table of timings and sizes after the other values
+	bool timings = false;
+};
+
 static std::string validMethod[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "PATCH"};
 
 static int str_toupper(char c)
@@ -25,6 +42,14 @@ static std::string w_checkstring(lua_State *L, int idx)
 	return std::string(str, len);
 }
 
+// Only valid while the string stays on the stack, or is otherwise referenced
+static StringRef w_checkstringref(lua_State *L, int idx)
+{
+	size_t len;
+	const char *str = luaL_checklstring(L, idx, &len);
+	return StringRef(str, len);
+}
+
 static void w_pushstring(lua_State *L, const std::string &str)
 {
 	lua_pushlstring(L, str.data(), str.size());
@@ -38,11 +63,12 @@ static void w_readheaders(lua_State *L, int idx, HTTPSClient::header_map &header
 	lua_pushnil(L);
 	while (lua_next(L, idx))
 	{
-		auto header = w_checkstring(L, -2);
-		headers[header] = w_checkstring(L, -1);
+		size_t nameSize, valueSize;
+		const char *name = luaL_checklstring(L, -2, &nameSize);
+		const char *value = luaL_checklstring(L, -1, &valueSize);
+		headers.set(StringRef(name, nameSize), StringRef(value, valueSize));
 		lua_pop(L, 1);
 	}
-	lua_pop(L, 1);
 }
 
 static std::string w_optmethod(lua_State *L, int idx, const std::string &defaultMethod)
@@ -61,45 +87,757 @@ static std::string w_optmethod(lua_State *L, int idx, const std::string &default
 	return str;
 }
 
-static int w_request(lua_State *L)
+// Timeouts are given in seconds, nil or 0 means none
+static std::chrono::milliseconds w_opttimeout(lua_State *L, int idx, const char *name)
+{
+	lua_getfield(L, idx, name);
+	if (!lua_isnil(L, -1) && lua_type(L, -1) != LUA_TNUMBER)
+		luaL_error(L, "bad option '%s' (number expected, got %s)", name, luaL_typename(L, -1));
+
+	double seconds = lua_isnil(L, -1) ? 0.0 : lua_tonumber(L, -1);
+	lua_pop(L, 1);
+
+	if (!(seconds >= 0.0))
+		luaL_error(L, "bad option '%s' (must not be negative)", name);
+
+	return std::chrono::milliseconds((long long) std::ceil(std::min(seconds, 1e9) * 1000.0));
+}
+
+// Reads the url at idx and the options following it. The body is borrowed
+// from Lua rather than copied, the string it points into is left on top of
+// the stack (nil if there is none) and has to stay referenced until the
+// request is done.
+static HTTPSClient::Request w_checkrequest(lua_State *L, int idx, ReplyFormat &format)
 {
-	auto url = w_checkstring(L, 1);
+	int opts = idx + 1;
+	auto url = w_checkstring(L, idx);
 	HTTPSClient::Request req(url);
 
-	bool advanced = false;
+	lua_pushnil(L);
+	int anchor = lua_gettop(L);
 
-	if (lua_istable(L, 2))
+	format = ReplyFormat();
+
+	if (lua_istable(L, opts))
 	{
-		advanced = true;
+		format.advanced = true;
 
 		std::string defaultMethod = "GET";
 
-		lua_getfield(L, 2, "data");
+		lua_getfield(L, opts, "data");
+		if (!lua_isnoneornil(L, -1))
+		{
+			// Functions are set up as a source by w_setcallbacks. Numbers are
+			// converted in place, so the anchor is what was checked, not the field.
+			if (!lua_isfunction(L, -1))
+			{
+				req.postdata = w_checkstringref(L, -1);
+				lua_pushvalue(L, -1);
+				lua_replace(L, anchor);
+			}
+			req.headers.set("Content-Type", "application/x-www-form-urlencoded");
+			defaultMethod = "POST";
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, opts, "datafile");
 		if (!lua_isnoneornil(L, -1))
 		{
-			req.postdata = w_checkstring(L, -1);
-			req.headers["Content-Type"] = "application/x-www-form-urlencoded";
+			req.postfile = w_checkstring(L, -1);
+			req.headers.set("Content-Type", "application/octet-stream");
 			defaultMethod = "POST";
 		}
 		lua_pop(L, 1);
 
-		lua_getfield(L, 2, "method");
+		lua_getfield(L, opts, "method");
 		req.method = w_optmethod(L, -1, defaultMethod);
 		lua_pop(L, 1);
 
-		lua_getfield(L, 2, "headers");
+		lua_getfield(L, opts, "headers");
 		if (!lua_isnoneornil(L, -1))
 			w_readheaders(L, -1, req.headers);
 		lua_pop(L, 1);
+
+		req.timeout = w_opttimeout(L, opts, "timeout");
+		req.connectTimeout = w_opttimeout(L, opts, "connect_timeout");
+		req.idleTimeout = w_opttimeout(L, opts, "idle_timeout");
+
+		lua_getfield(L, opts, "backend");
+		if (!lua_isnoneornil(L, -1))
+			req.backend = w_checkstring(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, opts, "decompress");
+		req.decompress = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 1);
+
+		lua_getfield(L, opts, "buffer");
+		format.buffer = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 1);
+
+		lua_getfield(L, opts, "timings");
+		format.timings = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 1);
+	}
+
+	return req;
+}
+
+static void w_pushheaders(lua_State *L, const HTTPSClient::header_map &headers)
+{
+	lua_newtable(L);
+	for (const auto &header : headers)
+	{
+		lua_pushlstring(L, header.name.data, header.name.size);
+		lua_pushlstring(L, header.value.data, header.value.size);
+		lua_settable(L, -3);
+	}
+}
+
+static void w_pushtimings(lua_State *L, const HTTPSClient::Reply &reply)
+{
+	const HTTPSClient::Timings &timings = reply.timings;
+	lua_newtable(L);
+
+	lua_pushnumber(L, timings.nameLookup);
+	lua_setfield(L, -2, "name_lookup");
+	lua_pushnumber(L, timings.connect);
+	lua_setfield(L, -2, "connect");
+	lua_pushnumber(L, timings.tlsHandshake);
+	lua_setfield(L, -2, "tls_handshake");
+	lua_pushnumber(L, timings.firstByte);
+	lua_setfield(L, -2, "first_byte");
+	lua_pushnumber(L, timings.total);
+	lua_setfield(L, -2, "total");
+
+	lua_pushnumber(L, (lua_Number) timings.bytesSent);
+	lua_setfield(L, -2, "bytes_sent");
+	lua_pushnumber(L, (lua_Number) timings.bytesReceived);
+	lua_setfield(L, -2, "bytes_received");
+	lua_pushboolean(L, timings.reused);
+	lua_setfield(L, -2, "reused");
+
+	lua_pushnumber(L, (lua_Number) reply.rawBodySize);
+	lua_setfield(L, -2, "raw_body_size");
+	lua_pushnumber(L, (lua_Number) reply.bodySize);
+	lua_setfield(L, -2, "body_size");
+}
+
+static int w_pusherror(lua_State *L, const std::string &errorMessage)
+{
+	lua_pushnil(L);
+	lua_pushstring(L, errorMessage.c_str());
+	return 2;
+}
+
+static const char *BUFFER_TYPE = "https.Buffer";
+
+static std::string *w_checkbuffer(lua_State *L, int idx)
+{
+	return static_cast<std::string *>(luaL_checkudata(L, idx, BUFFER_TYPE));
+}
+
+// Takes over the memory of data, the bytes themselves stay where they are
+static void w_pushbuffer(lua_State *L, std::string &&data)
+{
+	std::string *buffer = static_cast<std::string *>(lua_newuserdata(L, sizeof(std::string)));
+	new (buffer) std::string(std::move(data));
+
+	luaL_getmetatable(L, BUFFER_TYPE);
+	lua_setmetatable(L, -2);
+}
+
+// Pushes the body as a string, or moves it into a Buffer. With cache, the
+// buffer is kept in the registry and pushed again on later calls.
+static void w_pushbody(lua_State *L, std::string &body, bool buffer, int *cache)
+{
+	if (!buffer)
+		w_pushstring(L, body);
+	else if (cache && *cache != LUA_NOREF)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, *cache);
+	else
+	{
+		w_pushbuffer(L, std::move(body));
+
+		if (cache)
+		{
+			lua_pushvalue(L, -1);
+			*cache = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+	}
+}
+
+static int w_pushreply(lua_State *L, HTTPSClient::Reply &reply, const ReplyFormat &format, int *cache = nullptr)
+{
+	// A body that was cut off is no use, even with a status code
+	if (!reply.error.empty())
+		return w_pusherror(L, reply.error);
+
+	lua_pushinteger(L, reply.responseCode);
+	w_pushbody(L, reply.body, format.buffer, cache);
+
+	if (!format.advanced)
+		return 2;
+
+	w_pushheaders(L, reply.headers);
+	if (!format.timings)
+		return 3;
+
+	w_pushtimings(L, reply);
+	return 4;
+}
+
+// The sink, onheaders and data callbacks run in the middle of the request, so
+// their errors are kept here and reported once it returns
+struct LuaCallbacks
+{
+	lua_State *L = nullptr;
+	bool failed = false;
+	std::string error;
+
+	// Calls the function below the nargs arguments on top of the stack,
+	// anything but an explicit false lets the request continue
+	bool call(int nargs)
+	{
+		if (lua_pcall(L, nargs, 1, 0) != 0)
+		{
+			const char *message = lua_tostring(L, -1);
+			error = message ? message : "Error in request callback";
+			lua_pop(L, 1);
+			failed = true;
+			return false;
+		}
+
+		bool abort = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		if (abort)
+		{
+			error = "Request aborted";
+			failed = true;
+		}
+
+		return !abort;
+	}
+
+	// Calls the data function on top of the stack for the next piece of the
+	// body, nil or an empty string ends it
+	bool pull(std::string &chunk)
+	{
+		if (lua_pcall(L, 0, 1, 0) != 0)
+		{
+			const char *message = lua_tostring(L, -1);
+			error = message ? message : "Error in data function";
+			lua_pop(L, 1);
+			failed = true;
+			return false;
+		}
+
+		bool valid = lua_isnil(L, -1) || lua_type(L, -1) == LUA_TSTRING;
+		if (valid && !lua_isnil(L, -1))
+		{
+			size_t len;
+			const char *str = lua_tolstring(L, -1, &len);
+			chunk.assign(str, len);
+		}
+		lua_pop(L, 1);
+
+		if (!valid)
+		{
+			error = "data function must return a string or nil";
+			failed = true;
+		}
+
+		return valid;
+	}
+};
+
+static bool w_hascallbacks(lua_State *L, int opts)
+{
+	if (!lua_istable(L, opts))
+		return false;
+
+	bool found = false;
+	for (const char *name : {"sink", "onheaders"})
+	{
+		lua_getfield(L, opts, name);
+		if (!lua_isnil(L, -1) && !lua_isfunction(L, -1))
+			luaL_error(L, "bad option '%s' (function expected, got %s)", name, luaL_typename(L, -1));
+		found = found || lua_isfunction(L, -1);
+		lua_pop(L, 1);
+	}
+
+	lua_getfield(L, opts, "data");
+	found = found || lua_isfunction(L, -1);
+	lua_pop(L, 1);
+
+	return found;
+}
+
+static void w_setcallbacks(lua_State *L, HTTPSClient::Request &req, LuaCallbacks &callbacks)
+{
+	callbacks.L = L;
+
+	// The options table stays at index 2 for the duration of the request
+	lua_getfield(L, 2, "sink");
+	if (lua_isfunction(L, -1))
+	{
+		req.sink = [&callbacks](const char *data, size_t size) {
+			lua_State *L = callbacks.L;
+			lua_getfield(L, 2, "sink");
+			lua_pushlstring(L, data, size);
+			return callbacks.call(1);
+		};
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 2, "data");
+	if (lua_isfunction(L, -1))
+	{
+		req.source = [&callbacks](std::string &chunk) {
+			lua_getfield(callbacks.L, 2, "data");
+			return callbacks.pull(chunk);
+		};
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 2, "onheaders");
+	if (lua_isfunction(L, -1))
+	{
+		req.onHeaders = [&callbacks](int responseCode, const HTTPSClient::header_map &headers) {
+			lua_State *L = callbacks.L;
+			lua_getfield(L, 2, "onheaders");
+			lua_pushinteger(L, responseCode);
+			w_pushheaders(L, headers);
+			return callbacks.call(2);
+		};
+	}
+	lua_pop(L, 1);
+}
+
+// Bodies of async requests whose handle was collected while they were still
+// running. The garbage collector mustn't wait for the network, so they are
+// kept in the registry and let go by a later call once the request is done.
+static const char *PENDING_BODY_TYPE = "https.PendingBody";
+static const char *PENDING_BODIES = "https.pendingBodies";
+
+struct PendingBody
+{
+	std::shared_ptr<AsyncRequest> request;
+	int body;
+};
+
+static void w_addpending(lua_State *L, const std::shared_ptr<AsyncRequest> &request, int body)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, PENDING_BODIES);
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, PENDING_BODIES);
+	}
+
+	PendingBody *pending = static_cast<PendingBody *>(lua_newuserdata(L, sizeof(PendingBody)));
+	new (pending) PendingBody();
+	pending->request = request;
+	pending->body = body;
+	luaL_getmetatable(L, PENDING_BODY_TYPE);
+	lua_setmetatable(L, -2);
+
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+static void w_releasepending(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, PENDING_BODIES);
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		return;
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, -2))
+	{
+		lua_pop(L, 1);
+		PendingBody *pending = static_cast<PendingBody *>(lua_touserdata(L, -1));
+		if (pending->request->isDone())
+		{
+			luaL_unref(L, LUA_REGISTRYINDEX, pending->body);
+			pending->body = LUA_NOREF;
+
+			// Clearing a field that exists is allowed while traversing
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, -4);
+		}
 	}
+	lua_pop(L, 1);
+}
+
+static int w_pending_gc(lua_State *L)
+{
+	// Only still referenced when the whole state is closed, the body is about
+	// to be freed and the request may still be reading it
+	PendingBody *pending = static_cast<PendingBody *>(luaL_checkudata(L, 1, PENDING_BODY_TYPE));
+	if (pending->body != LUA_NOREF)
+		pending->request->wait();
+	pending->~PendingBody();
+	return 0;
+}
 
+static int w_request(lua_State *L)
+{
+	w_releasepending(L);
+	bool streaming = w_hascallbacks(L, 2);
+	ReplyFormat format;
+	HTTPSClient::Request req = w_checkrequest(L, 1, format);
 	HTTPSClient::Reply reply;
+	LuaCallbacks callbacks;
+
+	if (streaming)
+		w_setcallbacks(L, req, callbacks);
 
 	try
 	{
 		reply = request(req);
 	}
 	catch (const std::exception& e)
+	{
+		return w_pusherror(L, e.what());
+	}
+
+	if (callbacks.failed)
+		return w_pusherror(L, callbacks.error);
+
+	return w_pushreply(L, reply, format);
+}
+
+static int w_download(lua_State *L)
+{
+	w_releasepending(L);
+	std::string path = w_checkstring(L, 2);
+	// Leaves the options where w_checkrequest expects them
+	lua_remove(L, 2);
+
+	if (lua_istable(L, 2))
+	{
+		lua_getfield(L, 2, "sink");
+		if (!lua_isnil(L, -1))
+			return luaL_error(L, "sink is not supported by download");
+		lua_pop(L, 1);
+	}
+
+	bool streaming = w_hascallbacks(L, 2);
+	ReplyFormat format;
+	HTTPSClient::Request req = w_checkrequest(L, 1, format);
+	HTTPSClient::Reply reply;
+	LuaCallbacks callbacks;
+
+	if (streaming)
+		w_setcallbacks(L, req, callbacks);
+
+	try
+	{
+		reply = download(std::move(req), path);
+	}
+	catch (const std::exception& e)
+	{
+		return w_pusherror(L, e.what());
+	}
+
+	if (callbacks.failed)
+		return w_pusherror(L, callbacks.error);
+
+	lua_pushinteger(L, reply.responseCode);
+	w_pushheaders(L, reply.headers);
+	if (!format.timings)
+		return 2;
+
+	w_pushtimings(L, reply);
+	return 3;
+}
+
+static const char *ASYNC_REQUEST_TYPE = "https.AsyncRequest";
+
+struct AsyncHandle
+{
+	std::shared_ptr<AsyncRequest> request;
+	ReplyFormat format;
+	// Keeps the borrowed body alive in the registry while the request runs
+	int body;
+	// The Buffer the reply body was moved into, once result was called
+	int buffer;
+};
+
+static void w_releasebody(lua_State *L, AsyncHandle *handle)
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, handle->body);
+	handle->body = LUA_REFNIL;
+}
+
+static AsyncHandle *w_checkasync(lua_State *L, int idx)
+{
+	return static_cast<AsyncHandle *>(luaL_checkudata(L, idx, ASYNC_REQUEST_TYPE));
+}
+
+static int w_requestAsync(lua_State *L)
+{
+	w_releasepending(L);
+
+	// Lua can't be called from the threads running the request
+	if (w_hascallbacks(L, 2))
+		return luaL_error(L, "sink, onheaders and data functions are not supported by asynchronous requests");
+
+	ReplyFormat format;
+	HTTPSClient::Request req = w_checkrequest(L, 1, format);
+	int body = luaL_ref(L, LUA_REGISTRYINDEX);
+	std::shared_ptr<AsyncRequest> async;
+
+	try
+	{
+		async = requestAsync(req);
+	}
+	catch (const std::exception& e)
+	{
+		luaL_unref(L, LUA_REGISTRYINDEX, body);
+		return w_pusherror(L, e.what());
+	}
+
+	AsyncHandle *handle = static_cast<AsyncHandle *>(lua_newuserdata(L, sizeof(AsyncHandle)));
+	new (handle) AsyncHandle();
+	handle->request = std::move(async);
+	handle->format = format;
+	handle->body = body;
+	handle->buffer = LUA_NOREF;
+
+	luaL_getmetatable(L, ASYNC_REQUEST_TYPE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int w_async_poll(lua_State *L)
+{
+	AsyncHandle *handle = w_checkasync(L, 1);
+	w_releasepending(L);
+	lua_pushboolean(L, handle->request->isDone());
+	return 1;
+}
+
+static int w_async_result(lua_State *L)
+{
+	AsyncHandle *handle = w_checkasync(L, 1);
+	AsyncRequest &async = *handle->request;
+
+	// Blocks if the request is still running, use poll to avoid that
+	async.wait();
+	w_releasebody(L, handle);
+
+	if (async.failed())
+		return w_pusherror(L, async.getError());
+
+	return w_pushreply(L, async.getReply(), handle->format, &handle->buffer);
+}
+
+static int w_async_gc(lua_State *L)
+{
+	// The worker holds its own reference if the request is still running, but
+	// the body it reads belongs to Lua, so that stays until it's done
+	AsyncHandle *handle = w_checkasync(L, 1);
+	if (handle->body != LUA_REFNIL)
+	{
+		if (handle->request->isDone())
+			w_releasebody(L, handle);
+		else
+			w_addpending(L, handle->request, handle->body);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, handle->buffer);
+	handle->~AsyncHandle();
+	return 0;
+}
+
+// One result of requestMany, what https.request would have returned as a table
+static void w_pushresult(lua_State *L, AsyncRequest &async, const ReplyFormat &format)
+{
+	HTTPSClient::Reply &reply = async.getReply();
+	lua_newtable(L);
+
+	if (async.failed() || !reply.error.empty())
+	{
+		w_pushstring(L, async.failed() ? async.getError() : reply.error);
+		lua_setfield(L, -2, "error");
+		return;
+	}
+
+	lua_pushinteger(L, reply.responseCode);
+	lua_setfield(L, -2, "code");
+	w_pushbody(L, reply.body, format.buffer, nullptr);
+	lua_setfield(L, -2, "body");
+	w_pushheaders(L, reply.headers);
+	lua_setfield(L, -2, "headers");
+
+	if (format.timings)
+	{
+		w_pushtimings(L, reply);
+		lua_setfield(L, -2, "timings");
+	}
+}
+
+static const char *REQUEST_MANY_TYPE = "https.RequestMany";
+
+// Kept in a userdata while requestMany runs, so the errors raised while
+// reading the requests don't leak what was read so far
+struct ManyRequests
+{
+	std::vector<HTTPSClient::Request> reqs;
+	std::vector<ReplyFormat> formats;
+	std::vector<std::shared_ptr<AsyncRequest>> results;
+};
+
+static int w_many_gc(lua_State *L)
+{
+	static_cast<ManyRequests *>(luaL_checkudata(L, 1, REQUEST_MANY_TYPE))->~ManyRequests();
+	return 0;
+}
+
+static int w_requestMany(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	size_t concurrency = 6;
+	if (lua_istable(L, 2))
+	{
+		lua_getfield(L, 2, "concurrency");
+		if (!lua_isnil(L, -1))
+		{
+			if (lua_type(L, -1) != LUA_TNUMBER)
+				return luaL_error(L, "bad option 'concurrency' (number expected, got %s)", luaL_typename(L, -1));
+			if (!(lua_tonumber(L, -1) >= 1.0))
+				return luaL_error(L, "bad option 'concurrency' (must be at least 1)");
+			concurrency = (size_t) std::min(lua_tonumber(L, -1), 1024.0);
+		}
+		lua_pop(L, 1);
+	}
+
+	// Each entry is {url, options}, all of them are read before any request
+	// starts. The bodies they borrow are kept in anchors until all are done.
+	lua_newtable(L);
+	int anchors = lua_gettop(L);
+
+	ManyRequests *many = static_cast<ManyRequests *>(lua_newuserdata(L, sizeof(ManyRequests)));
+	new (many) ManyRequests();
+	luaL_getmetatable(L, REQUEST_MANY_TYPE);
+	lua_setmetatable(L, -2);
+
+	for (int i = 1; ; ++i)
+	{
+		lua_rawgeti(L, 1, i);
+		if (lua_isnil(L, -1))
+		{
+			lua_pop(L, 1);
+			break;
+		}
+
+		if (!lua_istable(L, -1))
+			return luaL_error(L, "bad request #%d (table expected, got %s)", i, luaL_typename(L, -1));
+
+		int entry = lua_gettop(L);
+		lua_rawgeti(L, entry, 1);
+		lua_rawgeti(L, entry, 2);
+
+		if (lua_type(L, entry + 1) != LUA_TSTRING)
+			return luaL_error(L, "bad request #%d (url expected, got %s)", i, luaL_typename(L, entry + 1));
+		// Lua can't be called from the threads running the requests
+		if (w_hascallbacks(L, entry + 2))
+			return luaL_error(L, "sink, onheaders and data functions are not supported by requestMany");
+
+		many->formats.emplace_back();
+		many->reqs.push_back(w_checkrequest(L, entry + 1, many->formats.back()));
+		lua_rawseti(L, anchors, i);
+		lua_settop(L, entry - 1);
+	}
+
+	try
+	{
+		many->results = requestMany(many->reqs, concurrency);
+	}
+	catch (const std::exception& e)
+	{
+		return w_pusherror(L, e.what());
+	}
+
+	lua_createtable(L, (int) many->results.size(), 0);
+	for (size_t i = 0; i < many->results.size(); ++i)
+	{
+		w_pushresult(L, *many->results[i], many->formats[i]);
+		lua_rawseti(L, -2, (int) i + 1);
+	}
+
+	return 1;
+}
+
+static int w_buffer_size(lua_State *L)
+{
+	lua_pushnumber(L, (lua_Number) w_checkbuffer(L, 1)->size());
+	return 1;
+}
+
+// For LuaJIT's FFI, valid as long as the buffer is
+static int w_buffer_pointer(lua_State *L)
+{
+	lua_pushlightuserdata(L, &(*w_checkbuffer(L, 1))[0]);
+	return 1;
+}
+
+// Same as string.sub, only the piece asked for becomes a string
+static int w_buffer_sub(lua_State *L)
+{
+	const std::string &buffer = *w_checkbuffer(L, 1);
+	lua_Number size = (lua_Number) buffer.size();
+	lua_Number start = luaL_checknumber(L, 2);
+	lua_Number end = luaL_optnumber(L, 3, -1);
+
+	if (start < 0)
+		start += size + 1;
+	if (end < 0)
+		end += size + 1;
+	start = std::max(start, (lua_Number) 1);
+	end = std::min(end, size);
+
+	if (start > end)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, buffer.data() + (size_t) start - 1, (size_t) (end - start) + 1);
+	return 1;
+}
+
+static int w_buffer_tostring(lua_State *L)
+{
+	w_pushstring(L, *w_checkbuffer(L, 1));
+	return 1;
+}
+
+static int w_buffer_gc(lua_State *L)
+{
+	using std::string;
+	w_checkbuffer(L, 1)->~string();
+	return 0;
+}
+
+static int w_setCABundle(lua_State *L)
+{
+	std::string pem;
+	if (!lua_isnoneornil(L, 1))
+		pem = w_checkstring(L, 1);
+
+	try
+	{
+		setCABundle(pem);
+	}
+	catch (const std::exception &e)
 	{
 		std::string errorMessage = e.what();
 		lua_pushnil(L);
@@ -107,29 +845,259 @@ static int w_request(lua_State *L)
 		return 2;
 	}
 
-	lua_pushinteger(L, reply.responseCode);
-	w_pushstring(L, reply.body);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int w_resolve(lua_State *L)
+{
+	std::string hostname = w_checkstring(L, 1);
+	resolve(hostname);
+	return 0;
+}
+
+static int w_setDNSCacheTTL(lua_State *L)
+{
+	double ttl = luaL_checknumber(L, 1);
+	double negativeTTL = luaL_optnumber(L, 2, std::min(ttl, 5.0));
+	setDNSCacheTTL(ttl, negativeTTL);
+	return 0;
+}
+
+static int w_init(lua_State *L)
+{
+	std::string backend;
+
+	try
+	{
+		backend = init();
+	}
+	catch (const std::exception &e)
+	{
+		return w_pusherror(L, e.what());
+	}
+
+	w_pushstring(L, backend);
+	return 1;
+}
+
+static int w_backends(lua_State *L)
+{
+	std::vector<std::string> names = getBackends();
+
+	lua_createtable(L, (int) names.size(), 0);
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		w_pushstring(L, names[i]);
+		lua_rawseti(L, -2, (int) i + 1);
+	}
+
+	std::string current = getBackend();
+	if (current.empty())
+		lua_pushnil(L);
+	else
+		w_pushstring(L, current);
+
+	return 2;
+}
+
+static int w_setBackend(lua_State *L)
+{
+	std::string name;
+	if (!lua_isnoneornil(L, 1))
+		name = w_checkstring(L, 1);
+
+	try
+	{
+		setBackend(name);
+	}
+	catch (const std::exception &e)
+	{
+		return w_pusherror(L, e.what());
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static void w_setcount(lua_State *L, const char *name, uint64_t count)
+{
+	lua_pushnumber(L, (lua_Number) count);
+	lua_setfield(L, -2, name);
+}
+
+static void w_setmicros(lua_State *L, const char *name, uint64_t micros)
+{
+	lua_pushnumber(L, micros / 1e6);
+	lua_setfield(L, -2, name);
+}
 
-	if (advanced)
+static void w_pushhistogram(lua_State *L, const Stats::Histogram &histogram)
+{
+	lua_newtable(L);
+
+	w_setcount(L, "count", histogram.count);
+	lua_pushnumber(L, histogram.totalMicros / 1e6 / histogram.count);
+	lua_setfield(L, -2, "mean");
+
+	w_setmicros(L, "p50", histogram.percentile(0.5));
+	w_setmicros(L, "p90", histogram.percentile(0.9));
+	w_setmicros(L, "p99", histogram.percentile(0.99));
+	w_setmicros(L, "p999", histogram.percentile(0.999));
+	w_setmicros(L, "max", histogram.percentile(1.0));
+
+	// Only the buckets that have anything in them, fastest first
+	lua_newtable(L);
+	int index = 0;
+	for (int i = 0; i < Stats::Histogram::bucketCount; ++i)
 	{
+		if (histogram.buckets[i] == 0)
+			continue;
+
 		lua_newtable(L);
-		for (const auto &header : reply.headers)
-		{
-			w_pushstring(L, header.first);
-			w_pushstring(L, header.second);
-			lua_settable(L, -3);
-		}
+		w_setmicros(L, "upper", Stats::Histogram::bucketEnd(i));
+		w_setcount(L, "count", histogram.buckets[i]);
+		lua_rawseti(L, -2, ++index);
+	}
+	lua_setfield(L, -2, "buckets");
+}
+
+static int w_stats(lua_State *L)
+{
+	Stats::Snapshot stats = getStats();
+	const uint64_t *counters = stats.counters;
+
+	lua_newtable(L);
+
+	lua_newtable(L);
+	w_setcount(L, "1xx", counters[Stats::REQUESTS_1XX]);
+	w_setcount(L, "2xx", counters[Stats::REQUESTS_2XX]);
+	w_setcount(L, "3xx", counters[Stats::REQUESTS_3XX]);
+	w_setcount(L, "4xx", counters[Stats::REQUESTS_4XX]);
+	w_setcount(L, "5xx", counters[Stats::REQUESTS_5XX]);
+	lua_setfield(L, -2, "requests");
+
+	lua_newtable(L);
+	w_setcount(L, "connect", counters[Stats::ERRORS_CONNECT]);
+	w_setcount(L, "timeout", counters[Stats::ERRORS_TIMEOUT]);
+	w_setcount(L, "response", counters[Stats::ERRORS_RESPONSE]);
+	w_setcount(L, "other", counters[Stats::ERRORS_OTHER]);
+	lua_setfield(L, -2, "errors");
+
+	lua_newtable(L);
+	w_setcount(L, "opened", counters[Stats::CONNECTIONS_OPENED]);
+	w_setcount(L, "reused", counters[Stats::CONNECTIONS_REUSED]);
+	w_setcount(L, "closed", counters[Stats::CONNECTIONS_CLOSED]);
+	lua_setfield(L, -2, "connections");
+
+	lua_newtable(L);
+	w_setcount(L, "full", counters[Stats::TLS_FULL]);
+	w_setcount(L, "resumed", counters[Stats::TLS_RESUMED]);
+	lua_setfield(L, -2, "tls_handshakes");
+
+	lua_newtable(L);
+	w_setcount(L, "sent", counters[Stats::BYTES_SENT]);
+	w_setcount(L, "received", counters[Stats::BYTES_RECEIVED]);
+	lua_setfield(L, -2, "bytes");
+
+	lua_newtable(L);
+	for (const auto &host : stats.latency)
+	{
+		w_pushhistogram(L, host.second);
+		lua_setfield(L, -2, host.first.c_str());
 	}
+	lua_setfield(L, -2, "latency");
+
+	return 1;
+}
 
-	return advanced ? 3 : 2;
+static int w_resetStats(lua_State *)
+{
+	resetStats();
+	return 0;
 }
 
 extern "C" int HTTPS_DLLEXPORT luaopen_https(lua_State *L)
 {
+	luaL_newmetatable(L, ASYNC_REQUEST_TYPE);
+
 	lua_newtable(L);
+	lua_pushcfunction(L, w_async_poll);
+	lua_setfield(L, -2, "poll");
+	lua_pushcfunction(L, w_async_result);
+	lua_setfield(L, -2, "result");
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, w_async_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, REQUEST_MANY_TYPE);
+	lua_pushcfunction(L, w_many_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, PENDING_BODY_TYPE);
+	lua_pushcfunction(L, w_pending_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, BUFFER_TYPE);
+
+	lua_newtable(L);
+	lua_pushcfunction(L, w_buffer_size);
+	lua_setfield(L, -2, "size");
+	lua_pushcfunction(L, w_buffer_pointer);
+	lua_setfield(L, -2, "pointer");
+	lua_pushcfunction(L, w_buffer_sub);
+	lua_setfield(L, -2, "sub");
+	lua_pushcfunction(L, w_buffer_tostring);
+	lua_setfield(L, -2, "tostring");
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, w_buffer_size);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, w_buffer_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+
+	lua_pushcfunction(L, w_init);
+	lua_setfield(L, -2, "init");
 
 	lua_pushcfunction(L, w_request);
 	lua_setfield(L, -2, "request");
 
+	lua_pushcfunction(L, w_download);
+	lua_setfield(L, -2, "download");
+
+	lua_pushcfunction(L, w_requestAsync);
+	lua_setfield(L, -2, "requestAsync");
+
+	lua_pushcfunction(L, w_requestMany);
+	lua_setfield(L, -2, "requestMany");
+
+	lua_pushcfunction(L, w_setCABundle);
+	lua_setfield(L, -2, "setCABundle");
+
+	lua_pushcfunction(L, w_resolve);
+	lua_setfield(L, -2, "resolve");
+
+	lua_pushcfunction(L, w_setDNSCacheTTL);
+	lua_setfield(L, -2, "setDNSCacheTTL");
+
+	lua_pushcfunction(L, w_backends);
+	lua_setfield(L, -2, "backends");
+
+	lua_pushcfunction(L, w_setBackend);
+	lua_setfield(L, -2, "setBackend");
+
+	lua_pushcfunction(L, w_stats);
+	lua_setfield(L, -2, "stats");
+
+	lua_pushcfunction(L, w_resetStats);
+	lua_setfield(L, -2, "resetStats");
+
 	return 1;
 }
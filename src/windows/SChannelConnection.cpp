@@ -13,6 +13,8 @@
 #include <memory>
 #include <array>
 
+#include "../common/Stats.h"
+
 #ifndef SCH_USE_STRONG_CRYPTO
 #	define SCH_USE_STRONG_CRYPTO 0x00400000
 #endif
@@ -22,6 +24,9 @@
 #ifndef SP_PROT_TLS1_2_CLIENT
 #	define SP_PROT_TLS1_2_CLIENT 0x00000800
 #endif
+#ifndef SSL_SESSION_RECONNECT
+#	define SSL_SESSION_RECONNECT 1
+#endif
 
 #ifdef DEBUG_SCHANNEL
 #include <iostream>
@@ -261,7 +266,15 @@ bool SChannelConnection::connect(const std::string &hostname, uint16_t port)
 	}
 
 	if (success)
+	{
+		SecPkgContext_SessionInfo sessionInfo;
+		bool resumed = QueryContextAttributes(context.get(), SECPKG_ATTR_SESSION_INFO, &sessionInfo) == SEC_E_OK
+			&& (sessionInfo.dwFlags & SSL_SESSION_RECONNECT) != 0;
+		Stats::add(resumed ? Stats::TLS_RESUMED : Stats::TLS_FULL);
+
 		this->context = context.release();
+		secured = clock::now();
+	}
 	else if (contextCreated)
 		DeleteSecurityContext(context.get());
 
@@ -467,6 +480,28 @@ void SChannelConnection::close()
 	socket.close();
 }
 
+void SChannelConnection::setTimeouts(clock::time_point deadline, std::chrono::milliseconds idle)
+{
+	socket.setTimeouts(deadline, idle);
+}
+
+bool SChannelConnection::timedOut() const
+{
+	return socket.timedOut();
+}
+
+bool SChannelConnection::isAlive()
+{
+	return context && encRecvBuffer.empty() && decRecvBuffer.empty() && socket.isAlive();
+}
+
+Connection::ConnectTimes SChannelConnection::getConnectTimes() const
+{
+	ConnectTimes times = socket.getConnectTimes();
+	times.secured = secured;
+	return times;
+}
+
 bool SChannelConnection::valid()
 {
 	return true;
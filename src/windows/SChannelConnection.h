@@ -20,6 +20,10 @@ public:
 	virtual size_t read(char *buffer, size_t size) override;
 	virtual size_t write(const char *buffer, size_t size) override;
 	virtual void close() override;
+	virtual void setTimeouts(clock::time_point deadline, std::chrono::milliseconds idle) override;
+	virtual bool timedOut() const override;
+	virtual bool isAlive() override;
+	virtual ConnectTimes getConnectTimes() const override;
 	virtual ~SChannelConnection();
 
 	static bool valid();
@@ -27,6 +31,7 @@ public:
 private:
 	PlaintextConnection socket;
 	CtxtHandle *context;
+	clock::time_point secured;
 	std::vector<char> encRecvBuffer;
 	std::vector<char> decRecvBuffer;
 
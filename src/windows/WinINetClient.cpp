@@ -3,6 +3,8 @@
 #ifdef HTTPS_BACKEND_WININET
 
 #include <algorithm>
+#include <chrono>
+#include <memory>
 #include <stdexcept>
 #include <sstream>
 #include <vector>
@@ -10,6 +12,7 @@
 #include <Windows.h>
 #include <wininet.h>
 
+#include "../common/FileReader.h"
 #include "../common/HTTPRequest.h"
 
 class LazyHInternetLoader final
@@ -46,6 +49,30 @@ private:
 
 static thread_local LazyHInternetLoader hInternetCache;
 
+// WinINet has no limit for the whole request, each wait gets the tighter of the two instead
+static void setTimeout(HINTERNET handle, DWORD option, std::chrono::milliseconds timeout, std::chrono::milliseconds total)
+{
+	if (timeout.count() == 0 || (total.count() > 0 && total < timeout))
+		timeout = total;
+
+	if (timeout.count() == 0)
+		return;
+
+	DWORD value = (DWORD) std::min<long long>(timeout.count(), MAXDWORD);
+	InternetSetOptionA(handle, option, &value, sizeof(DWORD));
+}
+
+static void closeHandles(HINTERNET hHTTP, HINTERNET hConnect)
+{
+	bool timedOut = GetLastError() == ERROR_INTERNET_TIMEOUT;
+
+	InternetCloseHandle(hHTTP);
+	InternetCloseHandle(hConnect);
+
+	if (timedOut)
+		throw HTTPSClient::TimeoutError();
+}
+
 bool WinINetClient::valid() const
 {
 	// Allow disablement of WinINet backend.
@@ -79,7 +106,7 @@ HTTPSClient::Reply WinINetClient::request(const HTTPSClient::Request &req)
 	// Keep-Alive
 	auto connectHeader = req.headers.find("Connection");
 	auto headerEnd = req.headers.end();
-	if ((connectHeader != headerEnd && connectHeader->second != "close") || connectHeader == headerEnd)
+	if ((connectHeader != headerEnd && connectHeader->value != "close") || connectHeader == headerEnd)
 		inetFlags |= INTERNET_FLAG_KEEP_CONNECTION;
 
 	// Open internet
@@ -125,31 +152,102 @@ HTTPSClient::Reply WinINetClient::request(const HTTPSClient::Request &req)
 		return reply;
 	}
 
+	setTimeout(hHTTP, INTERNET_OPTION_CONNECT_TIMEOUT, req.connectTimeout, req.timeout);
+	setTimeout(hHTTP, INTERNET_OPTION_SEND_TIMEOUT, req.idleTimeout, req.timeout);
+	setTimeout(hHTTP, INTERNET_OPTION_RECEIVE_TIMEOUT, req.idleTimeout, req.timeout);
+
+	// WinINet decodes gzip and deflate itself once asked to, but doesn't offer them
+	if (req.decompress)
+	{
+		BOOL decoding = TRUE;
+		InternetSetOptionA(hHTTP, INTERNET_OPTION_HTTP_DECODING, &decoding, sizeof(BOOL));
+		if (!req.headers.contains("Accept-Encoding"))
+			HttpAddRequestHeadersA(hHTTP, "Accept-Encoding: gzip, deflate\r\n", (DWORD) -1, HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE);
+	}
+
 	// Send additional headers
 	HttpAddRequestHeadersA(hHTTP, "User-Agent:", 0, HTTP_ADDREQ_FLAG_REPLACE);
 	for (const auto &header: req.headers)
 	{
-		std::string headerString = header.first + ": " + header.second + "\r\n";
+		std::string headerString = header.name.str() + ": " + header.value.str() + "\r\n";
 		HttpAddRequestHeadersA(hHTTP, headerString.c_str(), headerString.length(), HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE);
 	}
 
 	// POST data
 	const char *postData = nullptr;
-	if (req.postdata.length() > 0 && (httpMethod != "GET" && httpMethod != "HEAD"))
+	std::string sourceData;
+	std::unique_ptr<FileReader> file;
+	uint64_t postSize = 0;
+	if (req.hasBody() && (httpMethod != "GET" && httpMethod != "HEAD"))
 	{
+		bool ready = true;
+
+		try
+		{
+			if (!req.postfile.empty())
+			{
+				file.reset(new FileReader(req.postfile));
+				postSize = file->getSize();
+			}
+			else if (req.source)
+			{
+				// WinINet wants to know the size up front, so the source is collected first
+				ready = readBody(req, sourceData);
+				postData = sourceData.data();
+				postSize = sourceData.size();
+			}
+			else
+			{
+				postData = req.postdata.data;
+				postSize = req.postdata.size;
+			}
+		}
+		catch (const std::exception &)
+		{
+			ready = false;
+		}
+
+		if (!ready || postSize > MAXDWORD)
+		{
+			InternetCloseHandle(hHTTP);
+			InternetCloseHandle(hConnect);
+			return reply;
+		}
+
 		char temp[48];
-		int len = sprintf(temp, "Content-Length: %u\r\n", (unsigned int) req.postdata.length());
-		postData = req.postdata.c_str();
+		int len = sprintf(temp, "Content-Length: %u\r\n", (unsigned int) postSize);
 
 		HttpAddRequestHeadersA(hHTTP, temp, len, HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE);
 	}
 
 	// Send away!
-	BOOL result = HttpSendRequestA(hHTTP, nullptr, 0, (void *) postData, (DWORD) req.postdata.length());
+	BOOL result;
+	if (file)
+	{
+		// Files are streamed, the whole body never has to be in memory
+		INTERNET_BUFFERSA buffers;
+		memset(&buffers, 0, sizeof(buffers));
+		buffers.dwStructSize = sizeof(buffers);
+		buffers.dwBufferTotal = (DWORD) postSize;
+
+		result = HttpSendRequestExA(hHTTP, &buffers, nullptr, 0, 0);
+		for (uint64_t sent = 0; result && sent < postSize; )
+		{
+			char buffer[16384];
+			DWORD written = 0;
+			size_t read = file->read(buffer, sizeof(buffer));
+			result = read > 0 && InternetWriteFile(hHTTP, buffer, (DWORD) read, &written);
+			sent += read;
+		}
+
+		result = HttpEndRequestA(hHTTP, nullptr, 0, 0) && result;
+	}
+	else
+		result = HttpSendRequestA(hHTTP, nullptr, 0, (void *) postData, (DWORD) postSize);
+
 	if (!result)
 	{
-		InternetCloseHandle(hHTTP);
-		InternetCloseHandle(hConnect);
+		closeHandles(hHTTP, hConnect);
 		return reply;
 	}
 
@@ -190,10 +288,18 @@ HTTPSClient::Reply WinINetClient::request(const HTTPSClient::Request &req)
 		if (value)
 		{
 			ptrdiff_t keyLen = (ptrdiff_t) (value - headerData);
-			reply.headers[std::string(headerData, keyLen)] = value + 2; // +2, colon and 1 space character.
+			reply.headers.add(StringRef(headerData, keyLen), value + 2); // +2, colon and 1 space character.
 		}
 	}
 	responseHeaders.resize(1);
+	reply.responseCode = statusCode;
+
+	if (req.onHeaders && !req.onHeaders(reply.responseCode, reply.headers))
+	{
+		InternetCloseHandle(hHTTP);
+		InternetCloseHandle(hConnect);
+		return reply;
+	}
 
 	// Read response
 	std::stringstream responseData;
@@ -204,17 +310,32 @@ HTTPSClient::Reply WinINetClient::request(const HTTPSClient::Request &req)
 		DWORD readed = 0;
 
 		BOOL ret = InternetQueryDataAvailable(hHTTP, &readed, 0, 0);
+		if (!ret && GetLastError() == ERROR_INTERNET_TIMEOUT)
+			closeHandles(hHTTP, hConnect);
 		if (!ret || readed == 0)
 			break;
 
 		if (!InternetReadFile(hHTTP, buffer, BUFFER_SIZE, &readed))
+		{
+			if (GetLastError() == ERROR_INTERNET_TIMEOUT)
+				closeHandles(hHTTP, hConnect);
 			break;
+		}
+
+		reply.bodySize += readed;
 
-		responseData.write(buffer, readed);
+		if (req.sink)
+		{
+			if (!req.sink(buffer, readed))
+				break;
+		}
+		else
+			responseData.write(buffer, readed);
 	}
 
 	reply.body = responseData.str();
-	reply.responseCode = statusCode;
+	// Only the decoded size is known
+	reply.rawBodySize = reply.bodySize;
 
 	InternetCloseHandle(hHTTP);
 	InternetCloseHandle(hConnect);